@@ -1,12 +1,25 @@
 #include <SDL.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 // Memory and cpu
 uint8_t boot_rom[0x100] = {};  // boot rom
-uint8_t rom[0x100000] = {};   // cardridge data
-uint8_t ram[0x8000] = {};     // cardridge ram / up to 4 x 8kb banks
+uint8_t* rom = NULL;          // cardridge data, mapped from the rom file
+uint32_t rom_size = 0;
+uint8_t ram_static[0x20000] = {};
+uint8_t* ram = ram_static;    // cardridge ram / up to 16 x 8kb banks, mapped from the .sav file on battery carts
+uint32_t ram_size = 0x8000;
+bool ram_saved = true;        // battery carts keep ram in a .sav file
 uint8_t map[0x10000] = {};    // memory space visible by cpu
 
 uint16_t AF = 0; uint8_t& F = *((uint8_t*)&AF); uint8_t& A = *((uint8_t*)&AF + 1);
@@ -26,14 +39,32 @@ bool halted = false;
 
 // MBC state
 bool mbc_ram_enable = false;
-uint8_t mbc_rom_bank = 1;
-uint8_t mbc_ram_bank = 0;
+uint16_t mbc_rom_bank = 1;
+uint8_t mbc_ram_bank = 0;     // MBC3: 08-0C selects an rtc register instead
 uint8_t mbc_banking_mode = 0;
+// Switchable windows, only moved when a bank register is written
+uint8_t* rom_bank0 = NULL;
+uint8_t* rom_banked = NULL;
+uint8_t* ram_banked = ram_static;
+uint16_t ram_window_mask = 0x1FFF;
+// Ahead of time compiled blocks, see aot_load(). Per 16 KB of rom, and for the two rom windows.
+struct AotNext {
+    AotNext (*fn)();
+};
+typedef AotNext (*AotBlock)();
+AotBlock* aot_banks[0x200] = {};
+AotBlock* aot_window[2] = {};
+// MBC3 real time clock: seconds, minutes, hours, day low, day high. It runs on emulated cycles.
+uint8_t rtc_regs[5] = {};
+uint8_t rtc_latched[5] = {};
+uint8_t rtc_latch_last = 0xFF;
+uint64_t rtc_cycles = 0;      // cpu_cycles the registers are current to
+uint64_t cpu_cycles = 0;      // cycles run since power on
 // MBC Cardridge info
 uint8_t mbc_type_id = 0;
 uint8_t mbc_type = 0;
 uint8_t mbc_rom_size_info = 0;
-uint8_t mbc_rom_banks = 0;
+uint16_t mbc_rom_banks = 2;
 uint8_t mbc_ram_size_info = 0;
 uint8_t mbc_ram_banks = 0;
 
@@ -87,6 +118,7 @@ uint8_t& REG_NR41  = map[0xFF20];
 uint8_t& REG_NR42  = map[0xFF21];
 uint8_t& REG_NR43  = map[0xFF22];
 uint8_t& REG_NR44  = map[0xFF23];
+uint8_t& REG_NR50  = map[0xFF24];
 uint8_t& REG_NR51  = map[0xFF25];
 uint8_t& REG_NR52  = map[0xFF26];
 uint8_t& REG_LCDC  = map[0xFF40];
@@ -107,10 +139,63 @@ uint16_t sys_counter = 0; // System counter for timers
 uint16_t tima_timer_cycles = 0;
 uint8_t div_apu = 0;     // Running at 512 Hz
 uint16_t serial_timer = 0; // Serial transfer timer
+uint8_t serial_bits = 0;    // bits shifted in the current transfer
+bool link_start_sent = false; // the transfer went to the other end of the link
 
 // LCD state
 uint16_t lcd_window_line = 0;
 uint16_t lcd_scanline_cycles = 0;
+uint32_t lcd_pending_cycles = 0; // cpu cycles the lcd is behind
+uint32_t lcd_event_cycles = 0;   // pending cycles at which the lcd has to catch up by itself
+uint32_t lcd_frame_count = 0;    // completed frames
+bool lcd_compose = true;         // draw the scanlines of the current frame
+bool lcd_frame_ready = false;    // last completed frame was drawn
+
+// Registers a scanline is drawn with, sampled at mode 3. Doubles as the line signature.
+struct LineRegs {
+    uint8_t lcdc, scx, scy, wx, wy, bgp, obp0, obp1;
+    uint16_t window_line;
+};
+
+// Scanline skipping. Tiles, map rows and oam entries remember the draw serial at which they
+// last changed; a line is redrawn only if something it uses changed after it was last drawn.
+uint32_t lcd_draw_serial = 1;
+uint32_t lcd_tile_serial[384] = {};
+uint32_t lcd_map_serial[64] = {};  // 2 tilemaps x 32 rows
+uint32_t lcd_oam_serial[40] = {};
+uint32_t lcd_line_serial[144] = {}; // 0 = never drawn
+uint64_t lcd_line_sprites[144] = {};
+LineRegs lcd_line_regs[144] = {};
+uint64_t lcd_lines_drawn = 0;
+uint64_t lcd_lines_skipped = 0;
+
+// Memory the renderer reads vram/oam from and the buffer it draws into
+uint8_t* lcd_mem = map;
+uint32_t* lcd_out = screen;
+
+// Deferred rendering on a worker thread. The cpu records the registers each line is drawn
+// with, interleaved with a log of vram/oam writes; the worker replays both into its own copy.
+#define PPU_LOG_SIZE 0x8000
+struct PpuFrame {
+    uint8_t lines;
+    uint8_t line_ly[144];
+    LineRegs line_regs[144];
+    uint32_t line_log_pos[144]; // log entries to apply before drawing the line
+    uint32_t log_count;
+    uint32_t log[PPU_LOG_SIZE]; // addr << 8 | value
+    uint32_t frame;
+    bool composed;
+};
+bool ppu_thread = false;
+PpuFrame ppu_frames[2];
+PpuFrame* ppu_frame = &ppu_frames[0]; // being recorded
+PpuFrame* ppu_submitted = NULL;       // being rendered
+bool ppu_quit = false;
+bool ppu_busy = false;
+uint8_t ppu_mem[0x10000] = {};
+uint32_t ppu_screen[160 * 144] = {};
+SDL_sem* ppu_work = NULL;
+SDL_sem* ppu_done = NULL;
 
 // Sound channel 1 state
 bool sound_ch1_length_enable = false;
@@ -142,6 +227,69 @@ uint8_t sound_ch4_envelope_timer = 0;
 uint8_t sound_ch4_volume = 0;
 uint16_t sound_ch4_lfsr = 0;
 
+// Audio output. Samples are made on the emulation thread as emulated time passes and handed
+// to the audio callback through a single producer, single consumer ring.
+#define APU_RING_SIZE 8192                // stereo frames, power of two
+#define APU_LATENCY 1024                  // target ring fill, and frames buffered before playback (re)starts
+#define APU_SAMPLES_PER_CYCLE 49152000ULL // 48000 / 4194304 in 32.32 fixed point
+float apu_ring[APU_RING_SIZE * 2];
+SDL_atomic_t apu_ring_head = {};          // only written by the emulation thread
+SDL_atomic_t apu_ring_tail = {};          // only written by the audio callback
+bool apu_output = false;                 // channels are running, for playback or capture
+bool apu_playback = false;               // samples go to the ring
+bool apu_capturing = false;              // samples go to the wav file, audio hashes or shared memory
+bool apu_exact_rate = false;             // the wav file and audio hashes need the exact sample rate
+uint32_t apu_pending_cycles = 0;
+uint64_t apu_time = 0;                   // samples into blip_buffer, 32.32 fixed point
+uint32_t apu_flush_at = 64;              // settled samples handed over at a time
+
+// Channels only report changes of their output level. Each change is added to the channel's
+// delta buffer as a band-limited step (a windowed sinc spread over BLIP_WIDTH samples), and the
+// buffers are integrated into mono scratch blocks when flushed.
+#define BLIP_PHASES 32
+#define BLIP_WIDTH 16
+#define BLIP_SIZE 1024
+#define APU_CHUNK_CYCLES 32768 // about 380 samples, so a catch up never runs past BLIP_SIZE
+float blip_kernel[BLIP_PHASES][BLIP_WIDTH];
+float blip_buffer[4][BLIP_SIZE + BLIP_WIDTH] = {};
+float blip_sum[4] = {};
+float apu_scratch[4][BLIP_SIZE];
+float apu_mixed[BLIP_SIZE * 2];
+
+struct ApuVoice {
+    uint32_t timer;  // cycles until the next waveform step
+    uint8_t pos;     // duty step, wave sample
+    float level;     // current output level
+};
+ApuVoice apu_voice[4] = {};
+
+// Noise output for both LFSR widths, as states in step order from 0 (where a trigger starts it)
+// and the reverse mapping. changes has bit i set where the output after step i+1 differs, and
+// runs past the end so a run can be read without wrapping.
+uint16_t lfsr15_state[32767];
+uint16_t lfsr15_index[0x8000];
+uint64_t lfsr15_changes[32767 / 64 + 3];
+uint16_t lfsr7_state[127];
+uint16_t lfsr7_index[0x80];
+uint64_t lfsr7_changes[127 / 64 + 3];
+
+// Panning and master volume writes since the last flush, applied from sample `at` on
+#define APU_MIX_EVENTS 64
+struct ApuMixEvent { uint32_t at; uint8_t nr50, nr51; };
+ApuMixEvent apu_mix_events[APU_MIX_EVENTS];
+uint32_t apu_mix_count = 0;
+uint8_t apu_mix_nr50 = 0x77;             // in effect at the start of the next block
+uint8_t apu_mix_nr51 = 0xF3;
+uint64_t apu_mix_ticks = 0;
+uint32_t apu_mix_blocks = 0;
+uint32_t apu_underruns = 0;
+uint32_t apu_overruns = 0;
+uint64_t apu_rate = APU_SAMPLES_PER_CYCLE;
+float apu_fill = APU_LATENCY;            // smoothed ring fill
+float apu_drift = 0.0f;                  // slow part of the rate correction
+uint64_t apu_fill_sum = 0;
+uint32_t apu_fill_count = 0;
+
 // Keypad state
 uint8_t keys_state = 0x00; // all released
 uint8_t dpad_state = 0x00; // all released
@@ -187,16 +335,165 @@ void post_boot_teleport()
         map[io_init[i].addr] = io_init[i].val;
 }
 
+void ppu_drain();
+void lcd_catch_up();
+void apu_catch_up();
+void apu_mix_change();
+void apu_capture(uint32_t n);
+
+void lcd_mark_dirty(uint16_t addr)
+{
+    if(addr >= 0xFE00)
+        lcd_oam_serial[(addr - 0xFE00) >> 2] = lcd_draw_serial;
+    else if(addr < 0x9800)
+        lcd_tile_serial[(addr - 0x8000) >> 4] = lcd_draw_serial;
+    else
+        lcd_map_serial[(addr - 0x9800) >> 5] = lcd_draw_serial;
+}
+
+// Writes to vram and oam go through here to keep the scanline skip serials current
+void vram_write(uint16_t addr, uint8_t value)
+{
+    lcd_catch_up();
+    if(map[addr] == value)
+        return;
+    map[addr] = value;
+    if(!ppu_thread) {
+        lcd_mark_dirty(addr);
+        return;
+    }
+    if(ppu_frame->log_count == PPU_LOG_SIZE)
+        ppu_drain();
+    ppu_frame->log[ppu_frame->log_count++] = (addr << 8) | value;
+}
+
+// Points the rom and ram windows at the selected banks
+void mbc_remap()
+{
+    uint32_t bank0 = 0, bank = mbc_rom_bank, ram_bank = 0;
+    if(mbc_type == 1) {
+        // The 2 bit register is rom bank bits 5-6, and in mode 1 also the ram bank and bank 0 area
+        bank = (mbc_rom_bank & 0x1F) | (mbc_ram_bank << 5);
+        if(mbc_banking_mode == 1) {
+            bank0 = mbc_ram_bank << 5;
+            ram_bank = mbc_ram_bank;
+        }
+    }
+    else if(mbc_type == 3 || mbc_type == 5) {
+        ram_bank = mbc_ram_bank & 0x0F;
+    }
+    rom_bank0 = rom + (bank0 & (mbc_rom_banks - 1)) * 0x4000;
+    rom_banked = rom + (bank & (mbc_rom_banks - 1)) * 0x4000;
+    ram_banked = ram + ((ram_bank * 0x2000) & (ram_size - 1));
+    ram_window_mask = ram_size < 0x2000 ? ram_size - 1 : 0x1FFF;
+    // Blocks are compiled for the window their bank normally sits in
+    aot_window[0] = rom_bank0 == rom ? aot_banks[0] : NULL;
+    aot_window[1] = rom_banked != rom ? aot_banks[(rom_banked - rom) >> 14] : NULL;
+}
+
+void rtc_catch_up()
+{
+    while(cpu_cycles - rtc_cycles >= 4194304) {
+        rtc_cycles += 4194304;
+        if(rtc_regs[4] & 0x40)
+            continue; // halted
+        if(++rtc_regs[0] != 60)
+            continue;
+        rtc_regs[0] = 0;
+        if(++rtc_regs[1] != 60)
+            continue;
+        rtc_regs[1] = 0;
+        if(++rtc_regs[2] != 24)
+            continue;
+        rtc_regs[2] = 0;
+        if(++rtc_regs[3] != 0)
+            continue;
+        if(rtc_regs[4] & 0x01)
+            rtc_regs[4] = (rtc_regs[4] & 0xFE) | 0x80; // day counter overflow
+        else
+            rtc_regs[4] |= 0x01;
+    }
+}
+
+void mbc_write(uint16_t addr, uint8_t value)
+{
+    // MBC2 decodes address bit 8 instead of the range
+    if(mbc_type == 2 && addr <= 0x3FFF)
+        addr = (addr & 0x100) ? 0x2000 : 0x0000;
+
+    if(addr <= 0x1FFF) {
+        log_v_printf("Ram enable %02x (written to %04x)\n", value, addr);
+        if((value & 0x0F) == 0x0A) {
+            mbc_ram_enable = true;
+        } else {
+            // Games disable ram when done writing, a good time to start writing the save back
+            if(mbc_ram_enable && ram != ram_static)
+                msync(ram, ram_size, MS_ASYNC);
+            mbc_ram_enable = false;
+        }
+        return;
+    }
+    else if (addr <= 0x3FFF) {
+        if(mbc_type == 1) {
+            mbc_rom_bank = value & 0x1F;
+            if(mbc_rom_bank == 0) mbc_rom_bank++;
+        }
+        else if(mbc_type == 2) {
+            mbc_rom_bank = value & 0x0F;
+            if(mbc_rom_bank == 0) mbc_rom_bank++;
+        }
+        else if(mbc_type == 3) {
+            mbc_rom_bank = value & 0x7F;
+            if(mbc_rom_bank == 0) mbc_rom_bank++;
+        }
+        else if(mbc_type == 5) {
+            if(addr <= 0x2FFF)
+                mbc_rom_bank = (mbc_rom_bank & 0x100) | value;
+            else
+                mbc_rom_bank = (mbc_rom_bank & 0xFF) | ((value & 1) << 8);
+        }
+        else if(mbc_type == 0) {
+            log_v_printf("Ignoring write %02x to rom addr %04x\n", value, addr);
+            return;
+        }
+        else {
+            printf("Trying to write %02x to rom addr %04x\n", value, addr);
+            printf("Unknown MBC type %02x\n", mbc_type);
+            exit(1);
+        }
+        log_v_printf("MBC%i: Rom bank selected value: %02x bank: %02x\n", mbc_type, value, mbc_rom_bank);
+    }
+    else if (addr <= 0x5FFF) {
+        log_v_printf("MBC ram/rom bank select %02x\n", value);
+        if(mbc_type == 3 || mbc_type == 5)
+            mbc_ram_bank = value & 0x0F;
+        else if(mbc_type == 1)
+            mbc_ram_bank = value & 0x03;
+    }
+    else {
+        if(mbc_type == 3) {
+            // Writing 0 then 1 latches the clock
+            if(rtc_latch_last == 0 && value == 1) {
+                rtc_catch_up();
+                memcpy(rtc_latched, rtc_regs, sizeof(rtc_regs));
+            }
+            rtc_latch_last = value;
+            return;
+        }
+        log_v_printf("MBC bank mode %02x\n", value);
+        mbc_banking_mode = value & 1;
+    }
+    mbc_remap();
+}
+
 uint8_t read(uint16_t addr)
 {
     // Bank 0 rom
     if(addr <= 0x3FFF) {
-        return booting ? boot_rom[addr] : rom[addr];
+        return booting && addr < 0x100 ? boot_rom[addr] : rom_bank0[addr];
     }
     else if (addr <= 0x7FFF) {
-        uint8_t bank_mask = mbc_rom_banks - 1;
-        uint32_t bank_base = (mbc_rom_bank & bank_mask) * 0x4000;
-        return rom[bank_base + addr - 0x4000];
+        return rom_banked[addr - 0x4000];
     }
     // VRAM
     else if (addr >= 0x8000 && addr <= 0x9FFF) {
@@ -205,10 +502,11 @@ uint8_t read(uint16_t addr)
     // RAM
     else if (addr >= 0xA000 && addr <= 0xBFFF) {
         if(mbc_ram_enable) {
-            uint8_t bank = 0;
-            if(mbc_banking_mode == 1)
-                bank = mbc_ram_bank;
-            return ram[addr - 0xA000 + bank * 0x2000];
+            if(mbc_type == 3 && mbc_ram_bank >= 0x08)
+                return mbc_ram_bank <= 0x0C ? rtc_latched[mbc_ram_bank - 0x08] : 0xFF;
+            if(mbc_type == 2)
+                return ram_banked[addr & ram_window_mask] | 0xF0; // 4 bit cells
+            return ram_banked[addr & ram_window_mask];
         }
         else {
             printf("Trying to read from disabled ram at addr %04x\n", addr);
@@ -230,6 +528,8 @@ uint8_t read(uint16_t addr)
     }
     // I/O Range and HRAM and Interrupt
     else if (addr >= 0xFF00) {
+        if(addr >= 0xFF40 && addr <= 0xFF4B)
+            lcd_catch_up();
         return map[addr];
     }
     else {
@@ -240,50 +540,53 @@ uint8_t read(uint16_t addr)
 }
 
 
-void write(uint16_t addr, uint8_t value)
+// Reads memory as the cpu sees it, without catching anything up, logging or quitting. Addresses
+// read() can't handle, and cart ram while it is disabled, read 0xFF.
+uint8_t peek(uint16_t addr)
 {
-    // Check against writing to rom
-    if(addr <= 0x1FFF) {
-        log_v_printf("Ram enable %02x (written to %04x)\n", value, addr);
-        if((value & 0x0F) == 0x0A)
-            mbc_ram_enable = true;
-        else
-            mbc_ram_enable = false;
-    }
-    else if (addr <= 0x3FFF) {
-        if(mbc_type == 1) {
-            mbc_rom_bank = value & 0x1F;
-            if(mbc_rom_bank == 0) mbc_rom_bank++;
-            log_v_printf("MBC1: Rom bank selected value: %02x bank: %02x\n", value, mbc_rom_bank);
-        }
-        else {
-            printf("Trying to write %02x to rom addr %04x\n", value, addr);
-            printf("Unknown MBC type %02x\n", mbc_type);
-            exit(1);
-        }
-    }
-    else if (addr <= 0x5FFF) {
-        log_v_printf("MBC ram/rom bank select %02x\n", value);
-        mbc_ram_bank = value & 0x03;
-    }
-    else if (addr <= 0x7FFF) {
-        log_v_printf("MBC bank mode %02x\n", value);
-        mbc_banking_mode = value & 1;
+    if(addr <= 0x3FFF)
+        return booting && addr < 0x100 ? boot_rom[addr] : rom_bank0[addr];
+    if(addr <= 0x7FFF)
+        return rom_banked[addr - 0x4000];
+    if(addr >= 0xA000 && addr <= 0xBFFF) {
+        if(!mbc_ram_enable)
+            return 0xFF;
+        if(mbc_type == 3 && mbc_ram_bank >= 0x08)
+            return mbc_ram_bank <= 0x0C ? rtc_latched[mbc_ram_bank - 0x08] : 0xFF;
+        if(mbc_type == 2)
+            return ram_banked[addr & ram_window_mask] | 0xF0;
+        return ram_banked[addr & ram_window_mask];
     }
-    else if (addr < 0x8000) {
-        printf("Trying to write %02x to rom addr %04x\n", value, addr);
-        return;
+    if(addr >= 0xE000 && addr <= 0xFDFF)
+        return map[addr - 0x2000];
+    if(addr >= 0xFEA0 && addr <= 0xFEFF)
+        return 0xFF;
+    return map[addr]; // vram, wram, oam, ports and hram
+}
+
+void write(uint16_t addr, uint8_t value)
+{
+    // Cartridge registers
+    if(addr <= 0x7FFF) {
+        mbc_write(addr, value);
     }
     // VRAM
     else if (addr >= 0x8000 && addr <= 0x9FFF) {
-        map[addr] = value;
+        vram_write(addr, value);
     }
     else if (addr >= 0xA000 && addr <= 0xBFFF) {
         if(mbc_ram_enable) {
-            uint8_t bank = 0;
-            if(mbc_banking_mode == 1)
-                bank = mbc_ram_bank;
-            ram[addr - 0xA000 + bank * 0x2000] = value;
+            if(mbc_type == 3 && mbc_ram_bank >= 0x08) {
+                static const uint8_t rtc_masks[] = {0x3F, 0x3F, 0x1F, 0xFF, 0xC1};
+                if(mbc_ram_bank > 0x0C)
+                    return;
+                rtc_catch_up();
+                if(mbc_ram_bank == 0x08)
+                    rtc_cycles = cpu_cycles; // restarts the second
+                rtc_regs[mbc_ram_bank - 0x08] = value & rtc_masks[mbc_ram_bank - 0x08];
+                return;
+            }
+            ram_banked[addr & ram_window_mask] = mbc_type == 2 ? value & 0x0F : value;
         }
         else {
             printf("Trying to write to disabled ram at addr %04x\n", addr);
@@ -298,7 +601,7 @@ void write(uint16_t addr, uint8_t value)
         map[addr - 0x2000] = value;
     }
     else if (addr >= 0xFE00 && addr <= 0xFE9F) {
-        map[addr] = value;
+        vram_write(addr, value);
     }
     else if(addr >= 0xFEA0 && addr <= 0xFEFF) {
         //printf("Trying to write %02x to forbidden range %04x (PC=%04x)\n", value, addr, PC);
@@ -307,6 +610,10 @@ void write(uint16_t addr, uint8_t value)
     // Ports
     else if(addr >= 0xFF00 && addr < 0xFF80)
     {
+        if(addr >= 0xFF40 && addr <= 0xFF4B)
+            lcd_catch_up();
+        if(addr >= 0xFF10 && addr <= 0xFF3F)
+            apu_catch_up();
         if(addr == 0xFF00) {
             if((value & 0x30) == 0x10) {
                 // NOTE: Inverted logic; Buttons
@@ -329,6 +636,10 @@ void write(uint16_t addr, uint8_t value)
             log_v_printf("Serial control write: %02x\n", value);
             value |= 0x7E;
             map[addr] = value;
+            if(value & 0x80) {
+                serial_bits = 0;
+                link_start_sent = false;
+            }
         }
         else if(addr == 0xFF04) {
             // DIV register reset
@@ -492,10 +803,12 @@ void write(uint16_t addr, uint8_t value)
         else if (addr == 0xFF24) {
             log_v_printf("Master & vin: %02x\n", value);
             map[addr] = value;
+            apu_mix_change();
         }
         else if (addr == 0xFF25) {
             log_v_printf("Sound pan %02x\n", value);
             map[addr] = value;
+            apu_mix_change();
         }
         else if (addr >= 0xFF30 && addr <= 0xFF3F) {
             log_v_printf("Wave pattern %04x : %02x\n", addr, value);
@@ -507,8 +820,9 @@ void write(uint16_t addr, uint8_t value)
         }
         else if(addr == 0xFF41) {
             log_v_printf("STAT: %02x\n", value);
-            value |= 0x80;
-            map[addr] = value;
+            // Mode and LYC match bits are read only
+            map[addr] = 0x80 | (value & 0x78) | (map[addr] & 0x07);
+            lcd_event_cycles = 0; // reschedule
         }
         else if (addr == 0xFF42) {
             map[addr] = value;
@@ -520,13 +834,14 @@ void write(uint16_t addr, uint8_t value)
         else if (addr == 0xFF45) {
             log_v_printf("LYC: %02x\n", value);
             map[addr] = value;
+            lcd_event_cycles = 0; // reschedule
         }
         else if (addr == 0xFF46) {
             log_v_printf("DMA: %02x\n", value);
             map[addr] = value;
             uint16_t source_addr = value << 8;
             for(int i = 0; i < 0xA0; i++) {
-                map[0xFE00 + i] = read(source_addr + i);
+                vram_write(0xFE00 + i, read(source_addr + i));
             }
         }
         else if (addr == 0xFF47) {
@@ -594,95 +909,363 @@ const int OP_T_STATES[] = {
         12,12,8, 4, 0,16, 8,16,12, 8,16, 4, 0, 0, 8,16  /* 0xF0 */
 };
 
-static inline void render_square_channel(float* fstream, int len, uint8_t ch_enable_mask, uint8_t pan_left_mask, uint8_t pan_right_mask, uint8_t duty_reg, uint16_t period_divider, uint8_t volume, float* phase)
+void blip_init()
 {
-    static const uint8_t duty_masks[] = { 0x7F, 0x7E, 0x1E, 0x81 };
-    float vol = (REG_NR52 & ch_enable_mask) ? 1.0f : 0.0f;
-    vol *= volume / 15.0f;
-    float panleft = (REG_NR51 & pan_left_mask) ? 1.0f : 0.0f;
-    float panright = (REG_NR51 & pan_right_mask) ? 1.0f : 0.0f;
-    uint8_t duty = duty_reg >> 6;
-    float rate = 1048576.0f / (2048 - period_divider);
-    uint8_t duty_mask = duty_masks[duty];
-    for(int i = 0, c = len / 4; i < c; i += 2) {
-        uint8_t iphase = (uint8_t)*phase & 0x0F;
-        bool low = (1 << iphase) & duty_mask;
-        float s = low ? -0.25f : 0.25f;
-        float l = s * vol * panleft;
-        float r = s * vol * panright;
-        fstream[i]   += l;
-        fstream[i + 1] += r;
-        *phase = *phase + rate / 48000.0f;
-        while(*phase >= 8.0f) *phase -= 8.0f;
-    }
-}
-
-// Simple audio callback playing a square wave
-void audio_callback(void* /*userdata*/, Uint8* stream, int len)
+    for(int p = 0; p < BLIP_PHASES; p++) {
+        double k[BLIP_WIDTH], sum = 0;
+        for(int i = 0; i < BLIP_WIDTH; i++) {
+            // Distance from the step, with the cutoff a bit under nyquist and a blackman window
+            double x = i - (BLIP_WIDTH / 2 - 1) - (double)p / BLIP_PHASES;
+            double sinc = x == 0 ? 1.0 : sin(M_PI * 0.9 * x) / (M_PI * 0.9 * x);
+            double w = 0.42 + 0.5 * cos(2 * M_PI * x / BLIP_WIDTH) + 0.08 * cos(4 * M_PI * x / BLIP_WIDTH);
+            k[i] = sinc * w;
+            sum += k[i];
+        }
+        for(int i = 0; i < BLIP_WIDTH; i++)
+            blip_kernel[p][i] = k[i] / sum;
+    }
+}
+
+static inline void blip_add(int ch, uint64_t time, float delta)
 {
-    static float ch1_phase = 0;
-    static float ch2_phase = 0;
-    static float ch3_phase = 0;
-    static float ch4_phase = 0;
-    float* fstream = (float*)stream;
+    const float* k = blip_kernel[(uint32_t)time >> (32 - 5)];
+    float* b = &blip_buffer[ch][time >> 32];
+    for(int i = 0; i < BLIP_WIDTH; i++)
+        b[i] += delta * k[i];
+}
+
+// Applies NR50 master volume and NR51 panning to all four channels in one pass
+void apu_mix(uint32_t from, uint32_t to, uint8_t nr50, uint8_t nr51)
+{
+    float left = (((nr50 >> 4) & 0x7) + 1) / 8.0f;
+    float right = ((nr50 & 0x7) + 1) / 8.0f;
+    float gl[4], gr[4];
+    for(int ch = 0; ch < 4; ch++) {
+        gl[ch] = (nr51 & (0x10 << ch)) ? left : 0.0f;
+        gr[ch] = (nr51 & (0x01 << ch)) ? right : 0.0f;
+    }
+    const float* c0 = apu_scratch[0];
+    const float* c1 = apu_scratch[1];
+    const float* c2 = apu_scratch[2];
+    const float* c3 = apu_scratch[3];
+    for(uint32_t i = from; i < to; i++) {
+        apu_mixed[i * 2] = c0[i] * gl[0] + c1[i] * gl[1] + c2[i] * gl[2] + c3[i] * gl[3];
+        apu_mixed[i * 2 + 1] = c0[i] * gr[0] + c1[i] * gr[1] + c2[i] * gr[2] + c3[i] * gr[3];
+    }
+}
+
+// Integrates and mixes the samples no later step can touch any more, and hands them to the
+// callback
+void apu_flush()
+{
+    uint32_t n = apu_time >> 32;
+    uint64_t mix_start = SDL_GetPerformanceCounter();
+    for(int ch = 0; ch < 4; ch++) {
+        // Slow leak to zero, like the output capacitor, so rounding can't build up an offset
+        float sum = blip_sum[ch];
+        for(uint32_t i = 0; i < n; i++) {
+            sum = sum * 0.9997f + blip_buffer[ch][i];
+            apu_scratch[ch][i] = sum;
+        }
+        blip_sum[ch] = fabsf(sum) < 1e-10f ? 0.0f : sum; // before it decays into denormals
+        memmove(blip_buffer[ch], blip_buffer[ch] + n, BLIP_WIDTH * sizeof(float));
+        memset(blip_buffer[ch] + BLIP_WIDTH, 0, n * sizeof(float));
+    }
 
-    memset(fstream, 0, len); // clear to 0.0 so we can add channel contributions
+    // Mix in runs between panning and volume changes
+    uint32_t from = 0, e = 0;
+    for(; e < apu_mix_count && apu_mix_events[e].at < n; e++) {
+        uint32_t at = apu_mix_events[e].at > from ? apu_mix_events[e].at : from;
+        apu_mix(from, at, apu_mix_nr50, apu_mix_nr51);
+        apu_mix_nr50 = apu_mix_events[e].nr50;
+        apu_mix_nr51 = apu_mix_events[e].nr51;
+        from = at;
+    }
+    apu_mix(from, n, apu_mix_nr50, apu_mix_nr51);
+    for(uint32_t i = e; i < apu_mix_count; i++) {
+        apu_mix_events[i - e] = apu_mix_events[i];
+        apu_mix_events[i - e].at -= n;
+    }
+    apu_mix_count -= e;
+    apu_mix_ticks += SDL_GetPerformanceCounter() - mix_start;
+    apu_mix_blocks++;
+
+    if(apu_capturing)
+        apu_capture(n);
+    if(apu_playback) {
+        uint32_t head = SDL_AtomicGet(&apu_ring_head);
+        uint32_t tail = SDL_AtomicGet(&apu_ring_tail);
+        uint32_t count = n;
+        if(APU_RING_SIZE - (head - tail) < count) {
+            apu_overruns += count - (APU_RING_SIZE - (head - tail));
+            count = APU_RING_SIZE - (head - tail);
+        }
+        for(uint32_t i = 0; i < count; i++, head++) {
+            apu_ring[(head & (APU_RING_SIZE - 1)) * 2] = apu_mixed[i * 2];
+            apu_ring[(head & (APU_RING_SIZE - 1)) * 2 + 1] = apu_mixed[i * 2 + 1];
+        }
+        SDL_AtomicSet(&apu_ring_head, head);
+
+        // The frame pacing and the audio clock drift apart. Nudging the sample rate by at most half
+        // a percent keeps the ring near its target fill, which is too small to hear as pitch.
+        uint32_t fill = head - tail;
+        apu_fill_sum += fill;
+        apu_fill_count++;
+        apu_fill += (fill - apu_fill) / 64.0f;
+        float error = (APU_LATENCY - apu_fill) / APU_LATENCY;
+        apu_drift += error * 0.000002f;
+        apu_drift = apu_drift > 0.005f ? 0.005f : apu_drift < -0.005f ? -0.005f : apu_drift;
+        float adjust = apu_drift + error * 0.004f;
+        adjust = adjust > 0.005f ? 0.005f : adjust < -0.005f ? -0.005f : adjust;
+        if(!apu_exact_rate) // shared memory follows playback
+            apu_rate = (uint64_t)(APU_SAMPLES_PER_CYCLE * (1.0 + adjust));
+    }
+
+    apu_time -= (uint64_t)n << 32;
+}
 
-    // Early return if sound is disabled
-    if((REG_NR52 & 0x80) == 0) {
+// Called after NR50 or NR51 changes. The new gains start where steps made at this moment come
+// out of the delta buffers.
+void apu_mix_change()
+{
+    if(!apu_output) {
+        apu_mix_nr50 = REG_NR50;
+        apu_mix_nr51 = REG_NR51;
         return;
     }
+    if(apu_mix_count == APU_MIX_EVENTS)
+        apu_flush();
+    if(apu_mix_count == APU_MIX_EVENTS)
+        apu_mix_count--;
+    ApuMixEvent& e = apu_mix_events[apu_mix_count++];
+    e.at = (apu_time >> 32) + BLIP_WIDTH / 2 - 1;
+    e.nr50 = REG_NR50;
+    e.nr51 = REG_NR51;
+}
+
+// Adds a step when the voice output changes, t cycles into the current catch up
+static inline void apu_set_level(int ch, float level, uint32_t t)
+{
+    ApuVoice& v = apu_voice[ch];
+    if(level != v.level) {
+        blip_add(ch, apu_time + t * apu_rate, level - v.level);
+        v.level = level;
+    }
+}
+
+void apu_run_square(int ch, uint8_t duty_reg, uint16_t period_divider, uint8_t volume, uint32_t cycles)
+{
+    static const uint8_t duty_masks[] = { 0x7F, 0x7E, 0x1E, 0x81 };
+    ApuVoice& v = apu_voice[ch];
+    uint8_t mask = duty_masks[duty_reg >> 6];
+    float vol = (REG_NR52 & (1 << ch)) ? volume / 15.0f : 0.0f;
+    uint32_t period = (2048 - period_divider) * 4;
+    if(v.timer == 0)
+        v.timer = period;
+    for(uint32_t t = 0;;) {
+        apu_set_level(ch, (((mask >> v.pos) & 1) ? -0.25f : 0.25f) * vol, t);
+
+        // Jump straight to the next duty step that changes the output
+        uint32_t steps = 1;
+        while(steps < 8 && (((mask >> ((v.pos + steps) & 7)) ^ (mask >> v.pos)) & 1) == 0)
+            steps++;
+        uint32_t until = vol == 0.0f ? 0xFFFFFFFF : v.timer + (steps - 1) * period;
+        if(until > cycles - t) {
+            uint32_t elapsed = cycles - t;
+            if(elapsed < v.timer) {
+                v.timer -= elapsed;
+            } else {
+                elapsed -= v.timer;
+                v.pos = (v.pos + 1 + elapsed / period) & 7;
+                v.timer = period - elapsed % period;
+            }
+            return;
+        }
+        t += until;
+        v.pos = (v.pos + steps) & 7;
+        v.timer = period;
+    }
+}
+
+void apu_run_wave(uint32_t cycles)
+{
+    static const float volumes[] = {0.0f, 1.0f, 0.5f, 0.25f};
+    ApuVoice& v = apu_voice[2];
+    float vol = (REG_NR52 & 0x04) ? volumes[sound_ch3_volume] : 0.0f;
+    uint32_t period = (2048 - sound_ch3_period_divider) * 2;
+    if(v.timer == 0)
+        v.timer = period;
+    uint32_t t = 0;
+    for(;;) {
+        uint8_t sample = map[0xFF30 + (v.pos >> 1)];
+        sample = (v.pos & 1) == 0 ? sample >> 4 : sample & 0x0F; // Upper nibble first
+        apu_set_level(2, (0.5f * sample / 15.0f - 0.25f) * vol, t);
+        if(v.timer > cycles - t)
+            break;
+        t += v.timer;
+        v.timer = period;
+        v.pos = (v.pos + 1) & 0x1F;
+    }
+    v.timer -= cycles - t;
+}
+
+static inline uint16_t lfsr_step(uint16_t lfsr, bool short_mode)
+{
+    uint16_t feedback = (lfsr & 1) ^ ((lfsr & 0x2) >> 1);
+    feedback = (~feedback & 0x1);
+    lfsr = (lfsr & 0x7FFF) | (feedback << 15);
+    if(short_mode) {
+        lfsr = (lfsr & 0xFF7F) | (feedback << 7);
+    }
+    return lfsr >> 1;
+}
+
+void lfsr_init()
+{
+    uint16_t lfsr = 0;
+    for(uint32_t i = 0; i < 32767; i++) {
+        lfsr15_state[i] = lfsr;
+        lfsr15_index[lfsr] = i;
+        lfsr = lfsr_step(lfsr, false);
+    }
+    lfsr15_index[0x7FFF] = 0xFFFF; // all ones never changes
+    lfsr = 0;
+    for(uint32_t i = 0; i < 127; i++) {
+        lfsr7_state[i] = lfsr;
+        lfsr7_index[lfsr] = i;
+        lfsr = lfsr_step(lfsr, true) & 0x7F;
+    }
+    lfsr7_index[0x7F] = 0xFFFF;
+    for(uint32_t i = 0; i < sizeof(lfsr15_changes) * 8; i++)
+        if((lfsr15_state[i % 32767] ^ lfsr15_state[(i + 1) % 32767]) & 1)
+            lfsr15_changes[i >> 6] |= 1ULL << (i & 63);
+    for(uint32_t i = 0; i < sizeof(lfsr7_changes) * 8; i++)
+        if((lfsr7_state[i % 127] ^ lfsr7_state[(i + 1) % 127]) & 1)
+            lfsr7_changes[i >> 6] |= 1ULL << (i & 63);
+}
+
+// Steps from index i until the output changes. Runs are at most 15 steps long.
+static inline uint32_t lfsr_run(const uint64_t* changes, uint32_t i)
+{
+    uint64_t bits = changes[i >> 6] >> (i & 63);
+    if(i & 63)
+        bits |= changes[(i >> 6) + 1] << (64 - (i & 63));
+    return __builtin_ctzll(bits) + 1;
+}
+
+// Same result as stepping the LFSR n times
+uint16_t lfsr_advance(uint16_t lfsr, uint32_t n, bool short_mode)
+{
+    if(short_mode) {
+        // Bits 7-14 only hold the last 8 feedback bits, so jump the low bits and step the rest
+        uint16_t i = lfsr7_index[lfsr & 0x7F];
+        if(i != 0xFFFF && n > 8) {
+            lfsr = lfsr7_state[(i + n - 8) % 127];
+            n = 8;
+        }
+    } else {
+        uint16_t i = lfsr15_index[lfsr];
+        if(i != 0xFFFF)
+            return lfsr15_state[(i + n) % 32767];
+    }
+    if(n > 16)
+        n = 16; // stuck at all ones by then
+    while(n--)
+        lfsr = lfsr_step(lfsr, short_mode);
+    return lfsr;
+}
+
+void apu_run_noise(uint32_t cycles)
+{
+    ApuVoice& v = apu_voice[3];
+    float vol = (REG_NR52 & 0x08) ? sound_ch4_volume / 15.0f : 0.0f;
+    uint32_t period = (REG_NR43 & 0x7 ? (REG_NR43 & 0x7) * 16 : 8) << (REG_NR43 >> 4);
+    if(v.timer == 0)
+        v.timer = period;
+    bool short_mode = REG_NR43 & 0x4;
+    uint32_t length = short_mode ? 127 : 32767;
+    const uint16_t* states = short_mode ? lfsr7_state : lfsr15_state;
+    const uint64_t* changes = short_mode ? lfsr7_changes : lfsr15_changes;
+    uint32_t index = short_mode ? lfsr7_index[sound_ch4_lfsr & 0x7F] : lfsr15_index[sound_ch4_lfsr];
+    bool stuck = index == 0xFFFF;
+
+    // Walk from one change of the output to the next
+    uint32_t steps = 0;
+    for(uint32_t t = 0;;) {
+        uint32_t i = stuck ? 0 : (index + steps) % length;
+        bool low = stuck ? true : states[i] & 0x1;
+        apu_set_level(3, (low ? -0.25f : 0.25f) * vol, t);
+        uint32_t run = stuck || vol == 0.0f ? 0 : lfsr_run(changes, i);
+        uint32_t until = run ? v.timer + (run - 1) * period : 0xFFFFFFFF;
+        if(until > cycles - t) {
+            uint32_t elapsed = cycles - t;
+            if(elapsed < v.timer) {
+                v.timer -= elapsed;
+            } else {
+                elapsed -= v.timer;
+                steps += 1 + elapsed / period;
+                v.timer = period - elapsed % period;
+            }
+            break;
+        }
+        t += until;
+        steps += run;
+        v.timer = period;
+    }
+    if(steps)
+        sound_ch4_lfsr = lfsr_advance(sound_ch4_lfsr, steps, short_mode);
+}
+
+// Runs the channels over the cycles since the last call. This runs before anything they depend
+// on changes, so register writes land on the right sample.
+void apu_catch_up()
+{
+    uint32_t cycles = apu_pending_cycles;
+    apu_pending_cycles = 0;
+    if(!apu_output)
+        return;
 
-    // CH1 - square with envelope and frequency sweep
-    render_square_channel(fstream, len, 0x01, 0x10, 0x01, REG_NR11, sound_ch1_period_divider, sound_ch1_volume, &ch1_phase);
-
-    // CH2 - square with envelope
-    render_square_channel(fstream, len, 0x02, 0x20, 0x02, REG_NR21, sound_ch2_period_divider, sound_ch2_volume, &ch2_phase);   
-
-    // CH3 - waveform
-    float ch3_volume = (REG_NR52 & 0x04) ? 1.0f : 0.0f;
-    float ch3_panleft = (REG_NR51 & 0x40) ? 1.0f : 0.0f;
-    float ch3_panright = (REG_NR51 & 0x04) ? 1.0f : 0.0f;
-    float ch3_rate = 2097152.0f / (2048 - sound_ch3_period_divider);
-    for(int i = 0, c = len / 4; i < c; i += 2) {
-        uint8_t iphase = (uint8_t)ch3_phase & 0x1F;
-        uint8_t sample = read(0xFF30 + (iphase >> 1));
-        sample = (iphase & 1) == 0 ? sample >> 4 : sample & 0x0F; // Upper nibble first
-        float s = 0.5f * sample / 15.0f - 0.25f; //  -0.25f - 0.25f
-        static const float volume[] = {0.0f, 1.0f, 0.5f, 0.25f};
-        s *= ch3_volume * volume[sound_ch3_volume];
-        fstream[i]   += s * ch3_panleft;
-        fstream[i + 1] += s * ch3_panright;
-        ch3_phase += ch3_rate / 48000.0f;
-        while (ch3_phase >= 32.0f) ch3_phase -= 32.0f;
-    }
-
-    // CH4 - noise
-    float ch4_vol = (REG_NR52 & 0x08) ? 1.0f : 0.0f;
-    ch4_vol *= sound_ch4_volume / 15.0f;
-    float ch4_panleft = (REG_NR51 & 0x80) ? 1.0f : 0.0f;
-    float ch4_panright = (REG_NR51 & 0x08) ? 1.0f : 0.0f;
-
-    float ch4_rate = 262144.0f / (REG_NR43 & 0x7 ? REG_NR43 & 0x7 : 0.5f);
-    ch4_rate /= (1 << (REG_NR43 >> 4));
-    for(int i = 0, c = len / 4; i < c; i += 2) {
-        float s = (sound_ch4_lfsr & 0x1) ? -0.25f : 0.25f;
-        float l = s * ch4_vol * ch4_panleft;
-        float r = s * ch4_vol * ch4_panright;
-        fstream[i]   += l;
-        fstream[i + 1] += r;
-        ch4_phase = ch4_phase + ch4_rate / 48000.0f;
-        while(ch4_phase > 1.0f) {
-            ch4_phase -= 1.0f;
-            uint16_t feedback = (sound_ch4_lfsr & 1) ^ ((sound_ch4_lfsr & 0x2) >> 1);
-            feedback = (~feedback & 0x1);
-            sound_ch4_lfsr = (sound_ch4_lfsr & 0x7FFF) | (feedback << 15);
-            if(REG_NR43 & 0x4) {
-                sound_ch4_lfsr = (sound_ch4_lfsr & 0xFF7F) | (feedback << 7);
-            }
-            sound_ch4_lfsr >>= 1;
+    // Usually a 512 Hz tick apart, but DIV writes hold the tick off, so long gaps go in chunks
+    do {
+        uint32_t chunk = cycles < APU_CHUNK_CYCLES ? cycles : APU_CHUNK_CYCLES;
+        cycles -= chunk;
+        if(REG_NR52 & 0x80) {
+            apu_run_square(0, REG_NR11, sound_ch1_period_divider, sound_ch1_volume, chunk);
+            apu_run_square(1, REG_NR21, sound_ch2_period_divider, sound_ch2_volume, chunk);
+            apu_run_wave(chunk);
+            apu_run_noise(chunk);
+        } else {
+            for(int ch = 0; ch < 4; ch++)
+                apu_set_level(ch, 0.0f, 0);
         }
+        apu_time += chunk * apu_rate;
+        if((apu_time >> 32) >= apu_flush_at)
+            apu_flush();
+    } while(cycles);
+}
+
+// Only copies out what the emulation thread made. Playback waits for some buffered audio at
+// the start and after running dry, so jitter in the frame pacing doesn't become clicks.
+void audio_callback(void* /*userdata*/, Uint8* stream, int len)
+{
+    static bool primed = false;
+    float* fstream = (float*)stream;
+    uint32_t frames = len / 8;
+    uint32_t tail = SDL_AtomicGet(&apu_ring_tail);
+    uint32_t avail = (uint32_t)SDL_AtomicGet(&apu_ring_head) - tail;
+    if(avail >= APU_LATENCY)
+        primed = true;
+    uint32_t n = primed ? (avail < frames ? avail : frames) : 0;
+    for(uint32_t i = 0; i < n; i++, tail++) {
+        fstream[i * 2] = apu_ring[(tail & (APU_RING_SIZE - 1)) * 2];
+        fstream[i * 2 + 1] = apu_ring[(tail & (APU_RING_SIZE - 1)) * 2 + 1];
     }
+    memset(fstream + n * 2, 0, (frames - n) * 8);
+    if(primed && n < frames) {
+        apu_underruns++;
+        primed = false;
+    }
+    SDL_AtomicSet(&apu_ring_tail, tail);
 }
 
 uint32_t disassemble = 0;
@@ -691,6 +1274,19 @@ uint32_t disassemble = 0;
 uint16_t break_at = 0xFFFF;
 bool show_profile_bar = false;
 bool upscale = true;
+
+// Headless: no window or audio, run unthrottled and only draw frames something needs
+bool headless = false;
+uint32_t max_frames = 0;
+bool quit = false;
+int quit_code = 0;
+
+// Turbo: run unthrottled and only draw the frames that get presented
+bool turbo = false;
+bool turbo_active = false;
+uint32_t turbo_compose_at = 0;   // first frame to draw again
+uint32_t turbo_present_frame = 0;
+uint64_t turbo_present_at = 0;
 uint32_t profile_bar[160] = {};
 
 int cpu_tick()
@@ -1234,141 +1830,2744 @@ void load_rom(uint8_t* dst, uint32_t size, const char* filename)
     fclose(f);
 }
 
-static inline uint32_t get_tile_pixel(int tilex, int subtilex, int tiley, int subtiley, uint8_t* tilemap, uint8_t palette)
+// Maps the rom file read only instead of copying it. Processes running the same rom share the
+// pages in the page cache.
+void map_rom(const char* filename)
+{
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0) {
+        printf("Failed to load rom from %s\n", filename);
+        exit(1);
+    }
+    if(st.st_size > 0x800000) {
+        printf("Rom too big (%lld bytes)\n", (long long)st.st_size);
+        exit(1);
+    }
+    rom_size = st.st_size;
+    if(rom_size < 0x8000) {
+        // Too small to map the two banks the cpu always sees, pad a copy instead
+        rom = (uint8_t*)malloc(0x8000);
+        memset(rom, 0xff, 0x8000);
+        if(read(fd, rom, rom_size) != (ssize_t)rom_size) {
+            printf("Failed to load rom from %s\n", filename);
+            exit(1);
+        }
+        rom_size = 0x8000;
+    } else {
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        flags |= MAP_POPULATE;
+#endif
+        rom = (uint8_t*)mmap(NULL, rom_size, PROT_READ, flags, fd, 0);
+        if(rom == MAP_FAILED) {
+            printf("Failed to map rom %s\n", filename);
+            exit(1);
+        }
+        madvise(rom, rom_size, MADV_WILLNEED);
+    }
+    close(fd);
+}
+
+// Path of a file next to the rom, with the rom's extension replaced by ext
+void rom_side_path(char* path, size_t size, const char* rom_file, const char* ext)
+{
+    snprintf(path, size - strlen(ext), "%s", rom_file);
+    char* dot = strrchr(path, '.');
+    if(dot && !strchr(dot, '/'))
+        *dot = 0;
+    strcat(path, ext);
+}
+
+// Battery ram lives in a .sav file next to the rom, mapped shared. Writes land in the page cache
+// and the kernel writes them back, so saving costs nothing on the emulation path.
+void map_save(const char* rom_file)
+{
+    char path[1024];
+    rom_side_path(path, sizeof(path), rom_file, ".sav");
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if(fd < 0 || fstat(fd, &st) != 0 || (st.st_size < ram_size && ftruncate(fd, ram_size) != 0)) {
+        printf("Failed to open save file %s\n", path);
+        if(fd >= 0)
+            close(fd);
+        return;
+    }
+    void* p = mmap(NULL, ram_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED) {
+        printf("Failed to map save file %s\n", path);
+        return;
+    }
+    ram = (uint8_t*)p;
+    printf("Save ram: %s\n", path);
+}
+
+static inline uint32_t get_tile_pixel(int tilex, int subtilex, int tiley, int subtiley, uint8_t* tilemap, uint8_t lcdc, uint8_t palette)
 {
     uint8_t tileidx = tilemap[tilex + tiley * 32];
-    uint8_t *tiledata = (REG_LCDC & 0x10) ? (map + 0x8000 + tileidx * 16) : (map + 0x9000 + ((int8_t)tileidx) * 16);
+    uint8_t *tiledata = (lcdc & 0x10) ? (lcd_mem + 0x8000 + tileidx * 16) : (lcd_mem + 0x9000 + ((int8_t)tileidx) * 16);
     tiledata += subtiley * 2;
     uint8_t mask = 0x80 >> subtilex;
     int paletteidx = (*tiledata & mask ? 1 : 0) + (*(tiledata + 1) & mask ? 2 : 0);
     return palette_colors[(palette >> (paletteidx * 2)) & 0x3];
 }
 
-int main(int argc, char* argv[]) {
-    char* rom_file = NULL;
-    char* boot_rom_file = NULL;
+static inline bool lcd_window_visible(uint8_t ly, const LineRegs& r)
+{
+    return (r.lcdc & 0x20) && (r.lcdc & 0x1) && (r.wy <= ly) && (r.wx <= 166);
+}
 
-    // Parse command line arguments
-    for(int i = 1; i < argc; i++) {
-        if(strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
-            CYCLES_PR_FRAME = atoi(argv[++i]);
-        } else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
-            boot_rom_file = argv[++i];
-        } else if(strcmp(argv[i], "-v") == 0) {
-            verbose_logging = true;
-        } else if(strcmp(argv[i], "-br") == 0 && i + 1 < argc) {
-            break_at = (uint16_t)strtol(argv[++i], NULL, 16);
-            printf("Breakpoint set at %04x\n", break_at);
-        } else {
-            rom_file = argv[i];
-        }
+// True if a tilemap row, or any of the 21 tiles from col it can put on a line, changed after serial
+static bool lcd_map_row_changed(uint8_t* tilemap, int row, int col, uint8_t lcdc, uint32_t serial)
+{
+    if(lcd_map_serial[(tilemap - lcd_mem - 0x9800) / 32 + row] > serial)
+        return true;
+    for(int i = 0; i < 21; ++i) {
+        uint8_t tileidx = tilemap[row * 32 + ((col + i) & 31)];
+        int slot = (lcdc & 0x10) ? tileidx : 256 + (int8_t)tileidx;
+        if(lcd_tile_serial[slot] > serial)
+            return true;
     }
+    return false;
+}
 
-    uint64_t timer_freq = SDL_GetPerformanceFrequency();
+// Draw scanline ly to screen, unless nothing it depends on changed since it was last drawn
+void lcd_render_line(uint8_t ly, const LineRegs& r)
+{
+    uint8_t* bg_tilemap = (r.lcdc & 0x8) ? (lcd_mem + 0x9C00) : (lcd_mem + 0x9800);
+    uint8_t* win_tilemap = (r.lcdc & 0x40) ? (lcd_mem + 0x9C00) : (lcd_mem + 0x9800);
+    bool window = lcd_window_visible(ly, r);
+    uint8_t sprite_height = (r.lcdc & 0x4) ? 16 : 8;
 
-    // Initialize SDL
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-        printf("SDL initialization failed: %s\n", SDL_GetError());
-        return 1;
+    // Find (up to 10) sprites on this scanline
+    uint16_t sprites_on_line[10] = {}; // upper byte = x position, lower byte = sprite index
+    uint64_t sprite_mask = 0;
+    int spritecount = 0;
+    if(r.lcdc & 0x2) {
+        uint8_t* oam = lcd_mem + 0xFE00;
+        for(int i = 0; i < 40; ++i)
+        {
+            uint8_t sprite_y = *oam++; // Y position on screen + 16
+            uint8_t sprite_x = *oam++; // X position on screen + 8
+            oam+=2;
+            if(sprite_y + sprite_height <= 16 || sprite_y >= 160) {
+                // Not visible
+                continue;
+            }
+            if(ly + 16 >= sprite_y && ly + 16 < sprite_y + sprite_height) {
+                uint16_t sprite_to_add = (sprite_x << 8) | i;
+                int place = spritecount;
+                while(place > 0 && sprites_on_line[place - 1] <= sprite_to_add) {
+                    sprites_on_line[place] = sprites_on_line[place - 1];
+                    place--;
+                }
+                sprites_on_line[place] = sprite_to_add;
+                sprite_mask |= 1ull << i;
+                spritecount++;
+                if(spritecount == 10)
+                    break;
+            }
+        }
     }
 
-    if (SDL_Init(SDL_INIT_AUDIO) < 0) {
-        printf("SDL audio initialization failed: %s\n", SDL_GetError());
-        return 1;
+    uint32_t serial = lcd_line_serial[ly];
+    bool unchanged = serial != 0 && sprite_mask == lcd_line_sprites[ly] &&
+        memcmp(&r, &lcd_line_regs[ly], sizeof(r)) == 0;
+    if(unchanged) {
+        uint8_t vy = ly + r.scy;
+        unchanged = !lcd_map_row_changed(bg_tilemap, vy >> 3, r.scx >> 3, r.lcdc, serial);
     }
-
-    // Create window
-    SDL_Window* window = SDL_CreateWindow(
-        "Ges emulator",
-        SDL_WINDOWPOS_CENTERED,
-        SDL_WINDOWPOS_CENTERED,
-        //160*SCREENSCALE, 144*SCREENSCALE,
-        240 * SCREENSCALE, 320 * SCREENSCALE,
-        SDL_WINDOW_SHOWN | SDL_WINDOW_INPUT_FOCUS
-    );
-
-    if (!window) {
-        printf("Window creation failed: %s\n", SDL_GetError());
-        SDL_Quit();
-        return 1;
+    if(unchanged && window)
+        unchanged = !lcd_map_row_changed(win_tilemap, r.window_line >> 3, 0, r.lcdc, serial);
+    for(int s = 0; unchanged && s < spritecount; ++s) {
+        uint8_t sprite_index = sprites_on_line[s] & 0xFF;
+        uint8_t sprite_tile = lcd_mem[0xFE00 + sprite_index * 4 + 2];
+        if(sprite_height == 16)
+            sprite_tile &= 0xFE;
+        unchanged = lcd_oam_serial[sprite_index] <= serial && lcd_tile_serial[sprite_tile] <= serial &&
+            (sprite_height == 8 || lcd_tile_serial[sprite_tile + 1] <= serial);
     }
-
-    SDL_ShowWindow(window);
-    SDL_RaiseWindow(window);
-
-    // Create renderer
-    SDL_Renderer* renderer = SDL_CreateRenderer(
-        window,
-        -1,
-        SDL_RENDERER_ACCELERATED
-    );
-
-    if (!renderer) {
-        printf("Renderer creation failed: %s\n", SDL_GetError());
-        SDL_DestroyWindow(window);
-        SDL_Quit();
-        return 1;
+    if(unchanged) {
+        lcd_lines_skipped++;
+        return;
     }
+    lcd_lines_drawn++;
+    lcd_line_regs[ly] = r;
+    lcd_line_sprites[ly] = sprite_mask;
+    lcd_line_serial[ly] = lcd_draw_serial++;
 
-    // Setup audio
-    SDL_AudioSpec spec = {}, obtained = {};
-    spec.freq = 48000;
-    spec.format = AUDIO_F32SYS;  
-    spec.channels = 2;
-    spec.samples = 512;
-    spec.callback = audio_callback;
-    spec.userdata = NULL;
-    SDL_AudioDeviceID audio_device;
-    audio_device = SDL_OpenAudioDevice(NULL, 0, &spec, &obtained, 0);
-    if (audio_device < 0) {
-        printf("Failed to open audio: %s\n", SDL_GetError());
-        return 1;
-    }
-    SDL_PauseAudioDevice(audio_device, 0); // Start audio playback
+    // Copy to screen from memory for this scanline
+    if(r.lcdc & 0x1) // BG enabled
+    {
+        for(int x = 0; x < 160; ++x)
+        {
+            uint8_t vx = x + r.scx, vy = ly + r.scy;
+            lcd_out[x + ly * 160] = get_tile_pixel(vx >> 3, vx & 0x7, vy >> 3, vy & 0x7, bg_tilemap, r.lcdc, r.bgp);
+        }
+    }
+    else {
+        // Blank, so the line doesn't depend on which earlier frames were drawn
+        for(int x = 0; x < 160; ++x)
+            lcd_out[x + ly * 160] = palette_colors[0];
+    }
+
+    // Draw window if enabled, in front of bg and overlaps this scanline
+    if(window) {
+        for(int win_x = 0; win_x < 160; ++win_x)
+        {
+            if(win_x + r.wx < 7) continue; // before screen
+            int x = win_x + r.wx - 7;
+            if(x >= 160) break;
+            lcd_out[x + ly * 160] = get_tile_pixel(win_x >> 3, win_x & 0x7, r.window_line >> 3, r.window_line & 0x7, win_tilemap, r.lcdc, r.bgp);
+        }
+    }
+
+    // Now draw spritecount sprites on scanline
+    for(int s = 0; s < spritecount; ++s) {
+
+        uint8_t sprite_x = sprites_on_line[s] >> 8; // X position on screen + 8
+        uint8_t sprite_index = sprites_on_line[s] & 0xFF;
+        uint8_t* oam_entry = lcd_mem + 0xFE00 + sprite_index * 4;
+        uint8_t sprite_y = *(oam_entry);     // Y position on screen + 16
+        uint8_t sprite_tile = *(oam_entry + 2); // Tile index
+        if(sprite_height == 16)
+            sprite_tile &= 0xFE; // force even tile number for 8x16 sprites
+        uint8_t sprite_attr = *(oam_entry+3); // Attributes
+        bool flip_x = (sprite_attr & 0x20) != 0;
+        bool flip_y = (sprite_attr & 0x40) != 0;
+        bool behind_bg = (sprite_attr & 0x80) != 0;
+        uint8_t palette = (sprite_attr & 0x10) ? r.obp1 : r.obp0;
+
+        int line_in_sprite = ly + 16 - sprite_y;
+        if(flip_y)
+            line_in_sprite = (sprite_height - 1) - line_in_sprite;
+        uint8_t* tiledata = lcd_mem + 0x8000 + sprite_tile * 16 + line_in_sprite * 2;
+
+        for(int xpix = 0; xpix < 8; ++xpix)
+        {
+            int screen_x = sprite_x + xpix - 8;
+            if(screen_x < 0 || screen_x >= 160)
+                continue;
+            int pixel_x_in_sprite = flip_x ? (7 - xpix) : xpix;
+            uint8_t mask = 0x80 >> pixel_x_in_sprite;
+            int paletteidx = (*tiledata) & mask ? 1 : 0;
+            paletteidx += (*(tiledata+1) & mask) ? 2 : 0;
+            if(paletteidx == 0)
+                continue; // Transparent pixel
+
+            // Get color from palette
+            int color = (palette >> (paletteidx * 2)) & 0x3;
+            // If behind bg and bg pixel not color 0, skip drawing
+            if(behind_bg) {
+                uint32_t bg_pixel = lcd_out[screen_x + ly * 160];
+                if(bg_pixel != 0x00000000)
+                    continue;
+            }
+            lcd_out[screen_x + ly * 160] = palette_colors[color];
+        }
+    }
+}
+
+// Video recording. Completed frames are copied into a pool of preallocated buffers and
+// converted and written by a writer thread. When the pool is full the frame is dropped.
+#define REC_POOL_SIZE 8
+FILE* rec_file = NULL;
+const char* rec_filename = NULL;
+uint32_t rec_every = 1;
+uint32_t rec_pool[REC_POOL_SIZE][160 * 144];
+uint32_t rec_head = 0; // next slot to fill
+uint32_t rec_tail = 0; // next slot to write
+uint32_t rec_frames = 0;
+uint32_t rec_dropped = 0;
+bool rec_quit = false;
+SDL_sem* rec_free = NULL;
+SDL_sem* rec_full = NULL;
+
+int rec_thread_main(void* /*data*/)
+{
+    static uint8_t yuv[160 * 144 * 3 / 2];
+    while(true) {
+        SDL_SemWait(rec_full);
+        if(rec_tail == rec_head && rec_quit)
+            break;
+        uint32_t* frame = rec_pool[rec_tail % REC_POOL_SIZE];
+        // BT.601 full range, 4:2:0. Color 0 is shown as the clear color.
+        uint8_t* y_plane = yuv;
+        uint8_t* u_plane = yuv + 160 * 144;
+        uint8_t* v_plane = u_plane + 80 * 72;
+        int u_sum[80] = {}, v_sum[80] = {};
+        for(int y = 0; y < 144; ++y) {
+            for(int x = 0; x < 160; ++x) {
+                uint32_t col = frame[x + y * 160];
+                if(!(col & 0xFF000000)) col = (200<<16)+(220<<8)+200;
+                int r = (col >> 16) & 0xff, g = (col >> 8) & 0xff, b = col & 0xff;
+                y_plane[x + y * 160] = (77 * r + 150 * g + 29 * b) >> 8;
+                u_sum[x >> 1] += (-43 * r - 85 * g + 128 * b) >> 8;
+                v_sum[x >> 1] += (128 * r - 107 * g - 21 * b) >> 8;
+            }
+            if(y & 1) {
+                for(int x = 0; x < 80; ++x) {
+                    u_plane[x + (y >> 1) * 80] = 128 + u_sum[x] / 4;
+                    v_plane[x + (y >> 1) * 80] = 128 + v_sum[x] / 4;
+                    u_sum[x] = v_sum[x] = 0;
+                }
+            }
+        }
+        rec_tail++;
+        SDL_SemPost(rec_free);
+        fwrite("FRAME\n", 6, 1, rec_file);
+        fwrite(yuv, sizeof(yuv), 1, rec_file);
+    }
+    return 0;
+}
+
+// Frame hashing for regression checks. XXH64 (seed 0) of the raw screen[] pixels.
+FILE* hash_file = NULL;
+uint32_t expect_frame = 0;
+uint64_t expect_hash = 0;
+bool expect_checked = false;
+
+uint64_t xxh64(const void* data, uint64_t len)
+{
+    static const uint64_t P1 = 11400714785074694791ull, P2 = 14029467366897019727ull, P3 = 1609587929392839161ull;
+    static const uint64_t P4 = 9650029242287828579ull, P5 = 2870177450012600261ull;
+    #define XXH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+    #define XXH_ROUND(acc, in) acc = XXH_ROTL(acc + (in) * P2, 31) * P1
+    const uint8_t* p = (const uint8_t*)data;
+    const uint8_t* end = p + len;
+    uint64_t h = P5;
+    if(len >= 32) {
+        uint64_t v[4] = { P1 + P2, P2, 0, 0 - P1 };
+        for(; p + 32 <= end; p += 32) {
+            uint64_t w[4];
+            memcpy(w, p, 32);
+            XXH_ROUND(v[0], w[0]);
+            XXH_ROUND(v[1], w[1]);
+            XXH_ROUND(v[2], w[2]);
+            XXH_ROUND(v[3], w[3]);
+        }
+        h = XXH_ROTL(v[0], 1) + XXH_ROTL(v[1], 7) + XXH_ROTL(v[2], 12) + XXH_ROTL(v[3], 18);
+        for(int i = 0; i < 4; ++i) {
+            uint64_t k = 0;
+            XXH_ROUND(k, v[i]);
+            h = (h ^ k) * P1 + P4;
+        }
+    }
+    h += len;
+    for(; p + 8 <= end; p += 8) {
+        uint64_t k = 0, w;
+        memcpy(&w, p, 8);
+        XXH_ROUND(k, w);
+        h = XXH_ROTL(h ^ k, 27) * P1 + P4;
+    }
+    if(p + 4 <= end) {
+        uint32_t w;
+        memcpy(&w, p, 4);
+        h = XXH_ROTL(h ^ (w * P1), 23) * P2 + P3;
+        p += 4;
+    }
+    for(; p < end; p++)
+        h = XXH_ROTL(h ^ (*p * P5), 11) * P1;
+    h ^= h >> 33; h *= P2;
+    h ^= h >> 29; h *= P3;
+    h ^= h >> 32;
+    #undef XXH_ROUND
+    #undef XXH_ROTL
+    return h;
+}
+
+uint64_t frame_hash(const uint32_t* pixels)
+{
+    return xxh64(pixels, 160 * 144 * 4);
+}
+
+// Shared memory output for other processes, such as a stream encoder. Every completed frame
+// and all audio go into rings in a POSIX shared memory object. Emulation never waits for the
+// reader: a reader that falls behind has its oldest frames overwritten, which are counted.
+#define SHM_MAGIC 0x4D534547 // GESM
+#define SHM_FRAMES 8
+#define SHM_AUDIO 65536      // stereo samples, a power of two
+struct ShmHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t frame_slots;
+    uint32_t audio_size;
+    SDL_atomic_t frame_seq;  // frames published, the last one is in slot (frame_seq - 1) % frame_slots
+    SDL_atomic_t audio_head; // stereo samples published, sample i is at (i % audio_size) * 2
+    SDL_atomic_t read_seq;   // written by the reader: frames it is done with
+    SDL_atomic_t dropped;    // frames overwritten before the reader was done with them
+};
+struct ShmFrame {
+    SDL_atomic_t seq;        // odd while the slot is written, 2 * n + 2 once frame n is in it
+    uint32_t frame;
+    uint32_t audio_end;      // audio_head when the frame completed
+    uint32_t reserved;
+    uint32_t pixels[160 * 144];
+};
+const char* shm_name = NULL;
+char shm_path[256];
+ShmHeader* shm = NULL;
+ShmFrame* shm_frames = NULL;
+float* shm_audio = NULL;     // float stereo at 48 kHz
+
+bool shm_init()
+{
+    snprintf(shm_path, sizeof(shm_path), "%s%s", shm_name[0] == '/' ? "" : "/", shm_name);
+    size_t size = sizeof(ShmHeader) + SHM_FRAMES * sizeof(ShmFrame) + SHM_AUDIO * 8;
+    int fd = shm_open(shm_path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0 || ftruncate(fd, size) != 0)
+        return false;
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED)
+        return false;
+    memset(p, 0, size);
+    shm = (ShmHeader*)p;
+    shm_frames = (ShmFrame*)(shm + 1);
+    shm_audio = (float*)(shm_frames + SHM_FRAMES);
+    shm->version = 1;
+    shm->frame_slots = SHM_FRAMES;
+    shm->audio_size = SHM_AUDIO;
+    SDL_AtomicSet((SDL_atomic_t*)&shm->magic, SHM_MAGIC); // last, the reader can start
+    return true;
+}
+
+void shm_frame(uint32_t frame)
+{
+    uint32_t n = SDL_AtomicGet(&shm->frame_seq);
+    if(n - (uint32_t)SDL_AtomicGet(&shm->read_seq) >= SHM_FRAMES)
+        SDL_AtomicAdd(&shm->dropped, 1);
+    ShmFrame& f = shm_frames[n % SHM_FRAMES];
+    SDL_AtomicSet(&f.seq, n * 2 + 1);
+    f.frame = frame;
+    f.audio_end = SDL_AtomicGet(&shm->audio_head);
+    memcpy(f.pixels, screen, sizeof(screen));
+    SDL_AtomicSet(&f.seq, n * 2 + 2);
+    SDL_AtomicSet(&shm->frame_seq, n + 1);
+}
+
+// Audio capture for regression checks. Samples come from emulated time at the exact rate, so
+// runs are reproducible. Each second of 16-bit stereo samples is written out and hashed.
+FILE* wav_file = NULL;
+const char* wav_filename = NULL;
+uint32_t wav_frames = 0;
+FILE* audio_hash_file = NULL;
+int16_t audio_second[48000 * 2];
+uint32_t audio_second_fill = 0;
+uint32_t audio_seconds = 0;
+
+void wav_write_header()
+{
+    uint8_t h[44];
+    uint32_t fields[][3] = {
+        {4, 36 + wav_frames * 4, 4}, {16, 16, 4}, {20, 1, 2}, {22, 2, 2}, {24, 48000, 4},
+        {28, 48000 * 4, 4}, {32, 4, 2}, {34, 16, 2}, {40, wav_frames * 4, 4}
+    };
+    memcpy(h, "RIFF", 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    memcpy(h + 36, "data", 4);
+    for(size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+        for(uint32_t b = 0; b < fields[i][2]; b++)
+            h[fields[i][0] + b] = fields[i][1] >> (b * 8);
+    fseek(wav_file, 0, SEEK_SET);
+    fwrite(h, sizeof(h), 1, wav_file);
+}
+
+void audio_second_done()
+{
+    if(wav_file) {
+        fwrite(audio_second, 4, audio_second_fill / 2, wav_file);
+        wav_frames += audio_second_fill / 2;
+    }
+    if(audio_hash_file)
+        fprintf(audio_hash_file, "%u %016llx\n", audio_seconds, (unsigned long long)xxh64(audio_second, audio_second_fill * 2));
+    audio_seconds++;
+    audio_second_fill = 0;
+}
+
+void apu_capture(uint32_t n)
+{
+    if(shm) {
+        uint32_t head = SDL_AtomicGet(&shm->audio_head);
+        for(uint32_t i = 0; i < n; i++, head++) {
+            shm_audio[(head & (SHM_AUDIO - 1)) * 2] = apu_mixed[i * 2];
+            shm_audio[(head & (SHM_AUDIO - 1)) * 2 + 1] = apu_mixed[i * 2 + 1];
+        }
+        SDL_AtomicSet(&shm->audio_head, head);
+    }
+    for(uint32_t i = 0; i < n * 2; i++) {
+        float v = apu_mixed[i] * 32767.0f;
+        audio_second[audio_second_fill++] = v > 32767.0f ? 32767 : v < -32767.0f ? -32767 : (int16_t)v;
+        if(audio_second_fill == 48000 * 2)
+            audio_second_done();
+    }
+}
+
+// Forked runs (branches and batch jobs) report back through memory shared with the parent
+#define BRANCH_PEEKS 16
+struct RunResult {
+    bool done;      // the last frame completed
+    uint32_t frame;
+    uint64_t hash;
+    uint8_t peek[BRANCH_PEEKS];
+};
+RunResult* run_result = NULL;
+uint32_t run_end = 0;              // last frame of this run
+const char* input_script = NULL;   // scripted input, see input_mask()
+uint32_t input_start = 0;          // frame the script starts at
+
+// Branching. Each line of the branch file runs from the starting state in its own forked
+// process, one per cpu at a time. Processes share the parent's memory copy on write, so a branch
+// only costs the pages it dirties.
+#define BRANCH_MAX 4096
+const char* branch_filename = NULL;
+uint32_t branch_frames = 60;
+uint16_t branch_peek[BRANCH_PEEKS];
+uint32_t branch_peeks = 0;
+
+// Batch runs. Each manifest line is a job: rom, frames, the expected hash of the last frame or -,
+// and optionally an input script. Jobs run in forked processes, one per cpu; a process that
+// finishes takes the next job, and the longest jobs are handed out first.
+#define BATCH_MAX 65536
+struct BatchJob {
+    uint32_t index;  // in the manifest
+    char* rom;
+    uint32_t frames;
+    uint64_t expect;
+    bool check;
+    char* inputs;
+    double seconds;
+    int status;
+};
+const char* batch_filename = NULL;
+const char* batch_report_filename = NULL;
+
+// Control socket. A controller on the unix socket drives emulation with commands, see
+// control_run(). Frames go through a file mapped next to the socket instead of the socket.
+#define CTRL_BUF (1 << 20)
+const char* control_path = NULL;
+
+// Frames that must be drawn even when nothing is presented
+bool lcd_frame_wanted(uint32_t frame)
+{
+    return (rec_file && frame % rec_every == 0) || hash_file || frame == expect_frame || frame == run_end || shm;
+}
+
+// screen[] holds completed frame number frame
+void lcd_frame_done(uint32_t frame)
+{
+    lcd_frame_ready = true;
+    if(run_result && frame == run_end) {
+        run_result->frame = frame;
+        run_result->hash = frame_hash(screen);
+        run_result->done = true;
+    }
+    if(hash_file || frame == expect_frame) {
+        uint64_t hash = frame_hash(screen);
+        if(hash_file)
+            fprintf(hash_file, "%u %016llx\n", frame, (unsigned long long)hash);
+        if(frame == expect_frame) {
+            expect_checked = true;
+            if(hash == expect_hash)
+                printf("Frame %u hash matches %016llx\n", frame, (unsigned long long)hash);
+            else
+                printf("Frame %u hash mismatch: got %016llx, expected %016llx\n", frame, (unsigned long long)hash, (unsigned long long)expect_hash);
+            quit = true;
+            quit_code = hash == expect_hash ? 0 : 1;
+        }
+    }
+    if(shm)
+        shm_frame(frame);
+    if(rec_file && frame % rec_every == 0) {
+        if(SDL_SemTryWait(rec_free) != 0) {
+            rec_dropped++;
+        }
+        else {
+            memcpy(rec_pool[rec_head % REC_POOL_SIZE], screen, sizeof(screen));
+            rec_head++;
+            rec_frames++;
+            SDL_SemPost(rec_full);
+        }
+    }
+}
+
+// Render a recorded frame into ppu_screen. Called by the worker, or by the cpu while the worker is idle.
+void ppu_process(PpuFrame* f)
+{
+    uint32_t pos = 0;
+    for(int i = 0; i < f->lines; ++i) {
+        for(; pos < f->line_log_pos[i]; ++pos) {
+            uint16_t addr = f->log[pos] >> 8;
+            ppu_mem[addr] = f->log[pos] & 0xFF;
+            lcd_mark_dirty(addr);
+        }
+        lcd_render_line(f->line_ly[i], f->line_regs[i]);
+    }
+    for(; pos < f->log_count; ++pos) {
+        uint16_t addr = f->log[pos] >> 8;
+        ppu_mem[addr] = f->log[pos] & 0xFF;
+        lcd_mark_dirty(addr);
+    }
+    f->lines = 0;
+    f->log_count = 0;
+}
+
+int ppu_thread_main(void* /*data*/)
+{
+    while(true) {
+        SDL_SemWait(ppu_work);
+        if(ppu_quit)
+            break;
+        ppu_process(ppu_submitted);
+        SDL_SemPost(ppu_done);
+    }
+    return 0;
+}
+
+// Wait for the worker to go idle and publish the frame it finished, if any
+void ppu_sync()
+{
+    SDL_SemWait(ppu_done);
+    if(ppu_busy) {
+        memcpy(screen, ppu_screen, sizeof(screen));
+        ppu_busy = false;
+        if(ppu_submitted->composed)
+            lcd_frame_done(ppu_submitted->frame);
+    }
+}
+
+// Hand the recorded frame to the worker and start recording the next one
+void ppu_submit(uint32_t frame, bool composed)
+{
+    ppu_sync();
+    ppu_frame->frame = frame;
+    ppu_frame->composed = composed;
+    ppu_submitted = ppu_frame;
+    ppu_frame = (ppu_frame == &ppu_frames[0]) ? &ppu_frames[1] : &ppu_frames[0];
+    ppu_busy = true;
+    SDL_SemPost(ppu_work);
+}
+
+// Recording buffer is full: render what is recorded so far on the cpu thread
+void ppu_drain()
+{
+    ppu_sync();
+    ppu_process(ppu_frame);
+    SDL_SemPost(ppu_done);
+}
+
+void ppu_record_line(uint8_t ly, const LineRegs& r)
+{
+    if(ppu_frame->lines == 144)
+        ppu_drain();
+    int i = ppu_frame->lines++;
+    ppu_frame->line_ly[i] = ly;
+    ppu_frame->line_regs[i] = r;
+    ppu_frame->line_log_pos[i] = ppu_frame->log_count;
+}
+
+// Advance the lcd by cycles, which must not cross a mode boundary
+void lcd_step(uint32_t cycles)
+{
+    // LCD logic that needs to happen when a scanline is completed
+    lcd_scanline_cycles += cycles;
+    bool draw_scanline = false;
+    if(lcd_scanline_cycles >= LCD_CYCLES_PER_SCANLINE) {
+
+        lcd_scanline_cycles -= LCD_CYCLES_PER_SCANLINE;
+
+        // Start a new scanline
+        REG_LY++;
+        if(REG_LY > LCD_SCANLINES) {
+            REG_LY=0;
+            lcd_window_line = 0;
+        }
+
+        // Update stat for LYC match and trigger LYC=LY interrupt if enabled
+        if(REG_LYC == REG_LY) {
+            REG_STAT |= 4;
+            // Fire interrupt if enabled
+            if (REG_STAT & 0x40) {
+                REG_IF |= 0x2;
+            }
+        } else {
+            REG_STAT &= ~4;
+        }
+
+        // Trigger interrupt if entering vblank
+        if(REG_LY == LCD_HEIGHT) {
+            lcd_frame_count++;
+            bool composed = lcd_compose;
+            lcd_compose = lcd_frame_wanted(lcd_frame_count + 1) || (!headless && (!turbo || lcd_frame_count >= turbo_compose_at));
+            if(ppu_thread)
+                ppu_submit(lcd_frame_count, composed);
+            else if(composed)
+                lcd_frame_done(lcd_frame_count);
+            // Always request VBlank interrupt
+            REG_IF |= 0x1; // Request VBlank interrupt
+            // If STAT mode 1 (vblank) interrupt enabled, request LCD STAT interrupt
+            if (REG_STAT & 0x10) {
+                REG_IF |= 0x2;
+            }
+        }
+        if (REG_LY >= LCD_HEIGHT) {
+            // VBlank lines
+            REG_STAT = (REG_STAT & ~3) | 1;
+        }
+        else {
+            // Visible scanlines all start in mode 2
+            REG_STAT = (REG_STAT & ~3) | 2;
+            // If stat mode 2 interrupt enabled, request LCD STAT interrupt
+            if(REG_STAT & 0x20) {
+                REG_IF |= 0x2;
+            }
+        }
+    }
+
+    // Handle LCD mode transition during scanline (only regular lines)
+    if(REG_LY < LCD_HEIGHT) {
+        if(lcd_scanline_cycles >= 80 && (REG_STAT & 3) == 2) {
+            // Switch to mode 3
+            REG_STAT = (REG_STAT & ~3) | 3;
+            draw_scanline = true; 
+        }
+        else if(lcd_scanline_cycles >= 80 + 172 && (REG_STAT & 3) == 3) {
+            // Switch to mode 0
+            REG_STAT = (REG_STAT & ~3) | 0;
+            // If stat mode 0 interrupt enabled, request LCD STAT interrupt
+            if (REG_STAT & 0x8) {
+                REG_IF |= 0x2;
+            }
+        }
+    }
+    if(draw_scanline) {
+        LineRegs r = { REG_LCDC, REG_SCX, REG_SCY, REG_WX, REG_WY, REG_BGP, REG_OBP0, REG_OBP1, lcd_window_line };
+        if(lcd_compose && ppu_thread)
+            ppu_record_line(REG_LY, r);
+        else if(lcd_compose)
+            lcd_render_line(REG_LY, r);
+        if(lcd_window_visible(REG_LY, r))
+            lcd_window_line++;
+    }
+}
+
+// Next mode boundary within the current scanline
+static uint16_t lcd_next_boundary()
+{
+    if(REG_LY < LCD_HEIGHT && (REG_STAT & 3) == 2)
+        return 80;
+    if(REG_LY < LCD_HEIGHT && (REG_STAT & 3) == 3)
+        return 80 + 172;
+    return LCD_CYCLES_PER_SCANLINE;
+}
+
+// Cycles from the current lcd position until line ly starts
+static uint32_t lcd_cycles_to_line(int ly)
+{
+    int lines = (ly - REG_LY - 1 + LCD_SCANLINES + 1) % (LCD_SCANLINES + 1);
+    return LCD_CYCLES_PER_SCANLINE - lcd_scanline_cycles + lines * LCD_CYCLES_PER_SCANLINE;
+}
+
+// Find how far the lcd can fall behind before it must raise an interrupt or finish a frame
+void lcd_schedule()
+{
+    if(REG_STAT & 0x28) {
+        // Mode 0 or mode 2 interrupt enabled; stop at every mode change
+        lcd_event_cycles = lcd_next_boundary() - lcd_scanline_cycles;
+        return;
+    }
+    lcd_event_cycles = lcd_cycles_to_line(LCD_HEIGHT);
+    if((REG_STAT & 0x40) && REG_LYC <= LCD_SCANLINES && lcd_cycles_to_line(REG_LYC) < lcd_event_cycles)
+        lcd_event_cycles = lcd_cycles_to_line(REG_LYC);
+}
+
+// Bring the lcd up to the cpu, drawing all scanlines that became due in one go
+void lcd_catch_up()
+{
+    if(lcd_pending_cycles == 0)
+        return;
+    while(lcd_pending_cycles > 0) {
+        uint32_t step = lcd_next_boundary() - lcd_scanline_cycles;
+        if(step > lcd_pending_cycles)
+            step = lcd_pending_cycles;
+        lcd_pending_cycles -= step;
+        lcd_step(step);
+    }
+    lcd_schedule();
+}
+
+// Link cable to another ges through a unix socket. The two run in lockstep, swapping a message
+// every link_quantum cycles. A transfer on the internal clock goes out in the next message, and
+// the other end answers with its byte in the message after if it was waiting for a transfer on
+// the external clock. Otherwise the line reads as 0xFF, as without a cable.
+#define LINK_START 0x01 // byte 1 is the byte sent
+#define LINK_REPLY 0x02 // byte 2 answers the last start
+const char* link_path = NULL;
+int link_fd = -1;
+uint32_t link_quantum = 4096; // about one byte at the normal clock
+uint32_t link_cycles = 0;
+uint8_t link_reply = 0;       // LINK_REPLY if an answer is due
+uint8_t link_reply_byte = 0;
+
+// Connects to the other end, or waits for it when this end is first
+bool link_open()
+{
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, link_path, sizeof(addr.sun_path) - 1);
+    link_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(link_fd < 0)
+        return false;
+    if(connect(link_fd, (sockaddr*)&addr, sizeof(addr)) == 0) {
+        printf("Linked through %s\n", link_path);
+        return true;
+    }
+    unlink(link_path);
+    int listener = link_fd;
+    link_fd = -1;
+    if(bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0)
+        return false;
+    printf("Waiting for the other end of the link on %s\n", link_path);
+    link_fd = accept(listener, NULL, NULL);
+    close(listener);
+    unlink(link_path);
+    return link_fd >= 0;
+}
+
+void link_sync()
+{
+    uint8_t out[3] = { link_reply, 0, link_reply_byte }, in[3];
+    if((REG_SC & 0x81) == 0x81 && !link_start_sent) {
+        out[0] |= LINK_START;
+        out[1] = REG_SB;
+        link_start_sent = true;
+    }
+    link_reply = 0;
+    uint32_t got = 0;
+    bool ok = send(link_fd, out, 3, MSG_NOSIGNAL) == 3;
+    while(ok && got < 3) {
+        ssize_t n = recv(link_fd, in + got, 3 - got, 0);
+        ok = n > 0;
+        got += ok ? n : 0;
+    }
+    if(!ok) {
+        printf("Link closed\n");
+        close(link_fd);
+        link_fd = -1;
+        return;
+    }
+    if((in[0] & LINK_REPLY) && link_start_sent && (REG_SC & 0x81) == 0x81) {
+        REG_SB = in[2];
+        REG_SC &= ~0x80;
+        REG_IF |= 0x8;
+    }
+    if(in[0] & LINK_START) {
+        link_reply = LINK_REPLY;
+        link_reply_byte = 0xFF;
+        if((REG_SC & 0x81) == 0x80) {
+            link_reply_byte = REG_SB;
+            REG_SB = in[1];
+            REG_SC &= ~0x80;
+            REG_IF |= 0x8;
+        }
+    }
+}
+
+int run_cycles_left = 0;
+uint32_t run_until_frame = 0;
+
+// Runs everything clocked with the cpu for the cycles the last instruction took. Inlined into
+// the interpreter loop, which is measurably slower with a call per instruction.
+static inline __attribute__((always_inline)) void cpu_clock(int cycles)
+{
+    // The lcd only runs when its next interrupt is due, or when the cpu touches video state
+    lcd_pending_cycles += cycles;
+    if(lcd_pending_cycles >= lcd_event_cycles)
+        lcd_catch_up();
+
+    apu_pending_cycles += cycles;
+    cpu_cycles += cycles;
+
+    // Update timers
+    bool apu_tick = false;
+    sys_counter += cycles;
+    uint8_t new_div = sys_counter >> 8;
+    if ((REG_DIV & 0x10) && !(new_div & 0x10)) {
+        // 512hz tick
+        div_apu++;
+        apu_tick = true;
+    }
+    REG_DIV = new_div;
+
+    static uint16_t tima_clock_cycles_table[] = {0x400, 0x10, 0x40, 0x100};
+    if ((REG_TAC & 0x4)) {
+        tima_timer_cycles += cycles;
+        uint16_t cycles = tima_clock_cycles_table[REG_TAC & 0x3];
+        while(tima_timer_cycles >= cycles) {
+            tima_timer_cycles -= cycles;
+            // TIMA clock tick
+            REG_TIMA++;
+            if(REG_TIMA == 0) {
+                // Overflow
+                REG_TIMA = REG_TMA;
+                REG_IF |= 0x4;
+            }
+        }
+    }
+
+    // Update serial timer. Without a cable, a transfer on the internal clock shifts in ones.
+    serial_timer += cycles;
+    if(serial_timer >= 512) {
+        serial_timer -= 512;
+        if((REG_SC & 0x81) == 0x81 && link_fd < 0) {
+            REG_SB = REG_SB << 1 | 1;
+            if(++serial_bits == 8) {
+                REG_SC &= ~0x80;
+                REG_IF |= 0x8;
+            }
+        }
+    }
+    if(link_fd >= 0) {
+        link_cycles += cycles;
+        if(link_cycles >= link_quantum) {
+            link_cycles -= link_quantum;
+            link_sync();
+        }
+    }
+
+    // Update sound timers
+    if(apu_tick) {
+        apu_catch_up();
+
+        if(!(REG_NR52 & 0x80)) {
+            // Sound disabled
+            return;
+        }
+
+        if(REG_NR52 & 0x1) {
+            // Channel 1 length timer
+            if(sound_ch1_length_enable && (div_apu & 0x1) == 0) {
+                sound_ch1_length_timer++;
+                if(sound_ch1_length_timer == 0x40) {
+                    REG_NR52 &= ~0x1; // disable chan 1
+                }
+            }
+
+            // Channel 1 envelope timer
+            uint8_t ch1_sweep_pace = REG_NR12 & 0x7;
+            // sweep_pace is at apu/8 = 64hz steps
+            if(ch1_sweep_pace > 0 && ((div_apu&0x7) == 0) && (++sound_ch1_envelope_timer == ch1_sweep_pace))
+            {
+                sound_ch1_envelope_timer = 0;
+                if(REG_NR12 & 0x8 && sound_ch1_volume < 15) {
+                    sound_ch1_volume++;
+                } else if (sound_ch1_volume > 0) {
+                    sound_ch1_volume--;
+                }
+            }
+
+            // Channel 1 frequency sweep timer
+            if(sound_ch1_frq_sweep_enabled) {
+                sound_ch1_frq_sweep_timer++;
+                if(sound_ch1_frq_sweep_timer >= ((REG_NR10 & 0x70) >> 2)) {
+                    sound_ch1_frq_sweep_timer = 0;
+                    uint16_t divider_change = sound_ch1_period_divider >> ((REG_NR10&0x7));
+                    if(REG_NR10 & 0x8) {
+                        sound_ch1_period_divider -= divider_change;
+                    } else {
+                        sound_ch1_period_divider += divider_change;
+                        if(sound_ch1_period_divider > 0x7FF) {
+                            sound_ch1_period_divider = 0x7FF;
+                            REG_NR52 &= ~0x1; // disable chan 1
+                        }
+                    }
+                    REG_NR13 = sound_ch1_period_divider & 0xFF;
+                    REG_NR14 = (REG_NR14 & 0xF8) | ((sound_ch1_period_divider >> 8) & 0x7);
+                }
+            }
+        }
+
+        if(REG_NR52 & 0x2) {
+
+            // Channel 2 length timer
+            if(sound_ch2_length_enable && (div_apu & 0x1) == 0) {
+                sound_ch2_length_timer++;
+                if(sound_ch2_length_timer == 0x40) {
+                    REG_NR52 &= ~0x2; // disable chan 2
+                }
+            }
+
+            // Channel 2 envelope timer
+            uint8_t ch2_sweep_pace = REG_NR22 & 0x7;
+            // sweep_pace is at apu/8 = 64hz steps
+            if(ch2_sweep_pace > 0 && ((div_apu&0x7) == 0) && (++sound_ch2_envelope_timer == ch2_sweep_pace))
+            {
+                sound_ch2_envelope_timer = 0;
+                if(REG_NR22 & 0x8 && sound_ch2_volume < 15) {
+                    sound_ch2_volume++;
+                } else if (sound_ch2_volume > 0) {
+                    sound_ch2_volume--;
+                }
+            }
+        }
+
+        if(REG_NR52 & 0x4) {
+            // Channel 3 length timer
+            if(sound_ch3_length_enable && (div_apu & 0x1) == 0) {
+                sound_ch3_length_timer++;
+                if(sound_ch3_length_timer == 0) {
+                    REG_NR52 &= ~0x4;
+                }
+            }
+        }
+
+        if(REG_NR52 & 0x8) {
+            // Channel 4 length timer
+            if(sound_ch4_length_enable && (div_apu & 0x1) == 0) {
+                sound_ch4_length_timer++;
+                if(sound_ch4_length_timer == 0x40) {
+                    REG_NR52 &= ~0x8; // disable chan 4
+                }
+            }   
+
+            // Channel 4 envelope timer
+            uint8_t ch4_sweep_pace = REG_NR42 & 0x7;
+            // sweep_pace is at apu/8 = 64hz steps
+            if(ch4_sweep_pace > 0 && ((div_apu&0x7) == 0) && (++sound_ch4_envelope_timer == ch4_sweep_pace)) {
+                sound_ch4_envelope_timer = 0;
+                if(REG_NR42 & 0x8 && sound_ch4_volume < 15) {
+                    sound_ch4_volume++;
+                } else if (sound_ch4_volume > 0) {
+                    sound_ch4_volume--;
+                }
+            }
+        }
+
+    }
+
+    run_cycles_left -= cycles;
+}
+
+// Runs the cpu and everything clocked with it for a number of cycles, or until frame completes
+// For compiled code, which can't inline it
+void aot_clock(int cycles)
+{
+    cpu_clock(cycles);
+}
+
+void run_cycles(int cycles_to_run, uint32_t until_frame)
+{
+    run_cycles_left = cycles_to_run;
+    run_until_frame = until_frame;
+    while (run_cycles_left > 0 && lcd_frame_count != until_frame) {
+        // Compiled code runs until it needs the interpreter, which also takes interrupts
+        AotBlock block = PC < 0x8000 && aot_window[PC >> 14] ? aot_window[PC >> 14][PC & 0x3FFF] : NULL;
+        if(block && !halted && !ime_true_pending && !booting && !(ime && (REG_IE & REG_IF & 0x1F))) {
+            for(AotNext next = { block }; next.fn; )
+                next = next.fn();
+        } else {
+            cpu_clock(cpu_tick());
+        }
+    }
+    lcd_catch_up();
+    apu_catch_up();
+}
+
+// Save states. A snapshot is the machine state laid out flat by state_sync(), taken between
+// frames when the lcd and apu are caught up. Stored snapshots are the XOR against a base
+// snapshot with the runs of unchanged words coded as counts, so consecutive frames cost a few KB.
+#define STATE_VERSION 3
+#define STATE_MAX (0x10000 + 0x20000 + 160 * 144 / 4 + 0x400)
+#define STATE_HEADER 20
+uint64_t state_raw[STATE_MAX / 8] = {};
+uint64_t state_zero[STATE_MAX / 8] = {};
+uint8_t state_packed[STATE_HEADER + STATE_MAX + 16];
+uint32_t state_words = 0;   // snapshot size of the loaded cartridge
+uint8_t* state_pos = NULL;
+bool state_saving = false;
+char state_filename[1024] = "ges.state";
+
+static inline void state_field(void* p, uint32_t n)
+{
+    if(state_saving)
+        memcpy(state_pos, p, n);
+    else
+        memcpy(p, state_pos, n);
+    state_pos += n;
+}
+#define STATE(x) state_field(&(x), sizeof(x))
+
+// Copies the machine state into raw when saving, out of it otherwise. Returns the size in words.
+// Without full, the frame being drawn and the cartridge ram are left out; they come last.
+// Without pixels, the frame is saved as zeros and not restored.
+uint32_t state_sync(uint64_t* raw, bool saving, bool full, bool pixels)
+{
+    state_pos = (uint8_t*)raw;
+    state_saving = saving;
+    STATE(map);
+    STATE(AF); STATE(BC); STATE(DE); STATE(HL); STATE(SP); STATE(PC);
+    STATE(ime); STATE(ime_true_pending); STATE(booting); STATE(halted);
+    STATE(mbc_ram_enable); STATE(mbc_rom_bank); STATE(mbc_ram_bank); STATE(mbc_banking_mode);
+    STATE(rtc_regs); STATE(rtc_latched); STATE(rtc_latch_last); STATE(rtc_cycles); STATE(cpu_cycles);
+    STATE(sys_counter); STATE(tima_timer_cycles); STATE(div_apu); STATE(serial_timer); STATE(serial_bits);
+    STATE(lcd_window_line); STATE(lcd_scanline_cycles); STATE(lcd_frame_count);
+    STATE(sound_ch1_length_enable); STATE(sound_ch1_length_timer); STATE(sound_ch1_period_divider);
+    STATE(sound_ch1_envelope_timer); STATE(sound_ch1_volume); STATE(sound_ch1_frq_sweep_timer); STATE(sound_ch1_frq_sweep_enabled);
+    STATE(sound_ch2_length_enable); STATE(sound_ch2_length_timer); STATE(sound_ch2_period_divider);
+    STATE(sound_ch2_envelope_timer); STATE(sound_ch2_volume);
+    STATE(sound_ch3_length_enable); STATE(sound_ch3_length_timer); STATE(sound_ch3_period_divider); STATE(sound_ch3_volume);
+    STATE(sound_ch4_length_enable); STATE(sound_ch4_length_timer); STATE(sound_ch4_envelope_timer);
+    STATE(sound_ch4_volume); STATE(sound_ch4_lfsr);
+    STATE(apu_voice);
+    if(full) {
+        // Lines of the frame being drawn, packed to 2 bits per pixel. Pixels only hold palette_colors.
+        for(int i = 0; i < 160 * 144 / 4; i++) {
+            uint32_t* px = lcd_out + i * 4;
+            if(!pixels) {
+                if(saving)
+                    state_pos[i] = 0;
+                continue;
+            }
+            if(saving) {
+                uint8_t b = 0;
+                for(int k = 0; k < 4; k++)
+                    b |= ((3 - ((px[k] >> 6) & 3)) & (px[k] >> 30)) << (k * 2); // alpha is clear only for color 0
+                state_pos[i] = b;
+            } else {
+                for(int k = 0; k < 4; k++)
+                    px[k] = palette_colors[(state_pos[i] >> (k * 2)) & 3];
+            }
+        }
+        state_pos += 160 * 144 / 4;
+        state_field(ram, ram_size);
+    }
+    return (state_pos - (uint8_t*)raw + 7) / 8;
+}
+
+// The frame being drawn is only current on the cpu thread once the ppu thread is drained.
+// Without pixels, the ppu thread is left running.
+void state_capture(uint64_t* raw, bool pixels)
+{
+    if(ppu_thread && pixels)
+        ppu_drain();
+    state_sync(raw, true, true, pixels);
+}
+
+void state_restore(uint64_t* raw, bool pixels)
+{
+    float levels[4];
+    for(int ch = 0; ch < 4; ch++)
+        levels[ch] = apu_voice[ch].level;
+    if(ppu_thread) {
+        // Drop what was recorded for the worker and give it the restored vram
+        ppu_sync();
+        ppu_frame->lines = 0;
+        ppu_frame->log_count = 0;
+    }
+    state_sync(raw, false, true, pixels);
+    // Loaded states aren't trusted: keep what indexes a table or bounds a loop in range
+    sound_ch3_volume &= 3;
+    sound_ch1_period_divider &= 0x7FF;
+    sound_ch2_period_divider &= 0x7FF;
+    sound_ch3_period_divider &= 0x7FF;
+    sound_ch4_lfsr &= 0x7FFF;
+    for(int ch = 0; ch < 4; ch++)
+        apu_voice[ch].pos &= ch == 2 ? 0x1F : 7;
+    if(REG_LY > LCD_SCANLINES)
+        REG_LY = LCD_SCANLINES;
+    lcd_scanline_cycles %= LCD_CYCLES_PER_SCANLINE;
+    if(lcd_window_line > LCD_HEIGHT)
+        lcd_window_line = LCD_HEIGHT;
+    // A visible line's mode can't be behind its cycle count
+    while(REG_LY < LCD_HEIGHT && (REG_STAT & 3) >= 2 && lcd_scanline_cycles >= lcd_next_boundary())
+        REG_STAT = (REG_STAT & ~3) | ((REG_STAT & 3) == 2 ? 3 : 0);
+    mbc_rom_bank &= 0x1FF;
+    mbc_ram_bank &= 0x0F;
+    mbc_banking_mode &= 1;
+    if(ppu_thread) {
+        memcpy(ppu_mem, map, sizeof(map));
+        SDL_SemPost(ppu_done);
+    }
+    memset(lcd_line_serial, 0, sizeof(lcd_line_serial));
+    mbc_remap();
+    lcd_schedule();
+    apu_mix_change();
+    // Voice levels jump to the restored ones through the band-limited steps
+    for(int ch = 0; ch < 4; ch++) {
+        float level = apu_voice[ch].level;
+        apu_voice[ch].level = levels[ch];
+        apu_set_level(ch, level, 0);
+    }
+}
+
+static inline uint8_t* state_put_count(uint8_t* out, uint32_t n)
+{
+    for(; n >= 0x80; n >>= 7)
+        *out++ = n | 0x80;
+    *out++ = n;
+    return out;
+}
+
+static inline bool state_get_count(const uint8_t*& in, const uint8_t* end, uint32_t& n)
+{
+    n = 0;
+    for(int shift = 0; in < end && shift < 32; shift += 7) {
+        n |= (uint32_t)(*in & 0x7F) << shift;
+        if(!(*in++ & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Codes raw against base as (unchanged words, changed words, xor of the changed words) runs
+uint32_t state_encode(const uint64_t* raw, const uint64_t* base, uint32_t words, uint8_t* out)
+{
+    uint8_t* o = out;
+    uint32_t i = 0;
+    while(i < words) {
+        uint32_t same = i;
+        while(same < words && raw[same] == base[same])
+            same++;
+        uint32_t diff = same;
+        while(diff < words && raw[diff] != base[diff])
+            diff++;
+        o = state_put_count(o, same - i);
+        o = state_put_count(o, diff - same);
+        for(uint32_t k = same; k < diff; k++) {
+            uint64_t x = raw[k] ^ base[k];
+            memcpy(o, &x, 8);
+            o += 8;
+        }
+        i = diff;
+    }
+    return o - out;
+}
+
+bool state_decode(const uint8_t* in, uint32_t len, const uint64_t* base, uint64_t* raw, uint32_t words)
+{
+    const uint8_t* end = in + len;
+    uint32_t i = 0;
+    while(in < end) {
+        uint32_t same, diff;
+        if(!state_get_count(in, end, same) || !state_get_count(in, end, diff))
+            return false;
+        if(same > words - i || diff > words - i - same || diff > (uint32_t)(end - in) / 8)
+            return false;
+        for(; same; same--, i++)
+            raw[i] = base[i];
+        for(; diff; diff--, i++) {
+            uint64_t x;
+            memcpy(&x, in, 8);
+            in += 8;
+            raw[i] = base[i] ^ x;
+        }
+    }
+    for(; i < words; i++)
+        raw[i] = base[i];
+    return true;
+}
+
+// Serialized states: magic, version, snapshot words, rom checksum, coded size, then the snapshot
+// coded against zeros. Returns the size, out needs room for sizeof(state_packed).
+uint32_t state_write(uint8_t* out)
+{
+    state_capture(state_raw, true);
+    uint32_t len = state_encode(state_raw, state_zero, state_words, out + STATE_HEADER);
+    uint32_t header[5] = { 0x53534547, STATE_VERSION, state_words, (uint32_t)(rom[0x14E] << 8 | rom[0x14F]), len };
+    memcpy(out, header, STATE_HEADER);
+    return STATE_HEADER + len;
+}
+
+bool state_read(const uint8_t* in, uint32_t len)
+{
+    uint32_t header[5] = {};
+    if(len < STATE_HEADER)
+        return false;
+    memcpy(header, in, STATE_HEADER);
+    bool ok = header[0] == 0x53534547 && header[1] == STATE_VERSION && header[2] == state_words &&
+        header[3] == (uint32_t)(rom[0x14E] << 8 | rom[0x14F]) && header[4] == len - STATE_HEADER &&
+        state_decode(in + STATE_HEADER, header[4], state_zero, state_raw, state_words);
+    if(ok)
+        state_restore(state_raw, true);
+    return ok;
+}
+
+void state_save(const char* filename)
+{
+    uint64_t start = SDL_GetPerformanceCounter();
+    uint32_t len = state_write(state_packed);
+    FILE* f = fopen(filename, "wb");
+    if(!f || fwrite(state_packed, len, 1, f) != 1) {
+        printf("Failed to write state %s\n", filename);
+        if(f)
+            fclose(f);
+        return;
+    }
+    fclose(f);
+    printf("Saved state %s (%u bytes, %.0f us)\n", filename, len,
+        (SDL_GetPerformanceCounter() - start) * 1e6 / SDL_GetPerformanceFrequency());
+}
+
+bool state_load(const char* filename)
+{
+    FILE* f = fopen(filename, "rb");
+    if(!f) {
+        printf("Failed to read state %s\n", filename);
+        return false;
+    }
+    uint32_t len = fread(state_packed, 1, sizeof(state_packed), f);
+    fclose(f);
+    if(!state_read(state_packed, len)) {
+        printf("State %s is not a version %u state of this rom\n", filename, STATE_VERSION);
+        return false;
+    }
+    printf("Loaded state %s\n", filename);
+    return true;
+}
+
+// Sets up the MBC and cartridge ram from the header of the rom. Battery ram and states of a rom
+// file are kept next to it.
+void cart_init(const char* rom_file)
+{
+    mbc_type_id = rom[0x147];
+    mbc_rom_size_info = rom[0x148];
+    mbc_ram_size_info = rom[0x149];
+    // By cartridge type id: 0 no mbc, 1/2/3/5 MBCn, FF unsupported
+    static const uint8_t mbc_type_table[0x20] = {
+        0, 1, 1, 1, 0xFF, 2, 2, 0xFF, 0, 0, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 3,
+        3, 3, 3, 3, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 5, 5, 5, 5, 5, 5, 0xFF };
+    static const uint8_t mbc_ram_banks_table[] = {0, 0, 1, 4, 16, 8}; // Number of 8KB RAM banks
+    mbc_ram_banks = mbc_ram_size_info < 6 ? mbc_ram_banks_table[mbc_ram_size_info] : 0;
+    mbc_rom_banks = mbc_rom_size_info <= 8 ? 2 << mbc_rom_size_info : 2;
+    while(mbc_rom_banks > 2 && mbc_rom_banks * 0x4000u > rom_size)
+        mbc_rom_banks >>= 1; // header claims more than the file has
+    mbc_type = mbc_type_id < 0x20 ? mbc_type_table[mbc_type_id] : 0xFF;
+    printf("MBC type id: %02x\n", mbc_type_id);
+    printf("MBC type: %02x\n", mbc_type);
+    printf("MBC rom size: %02x (%i banks)\n", mbc_rom_size_info, mbc_rom_banks);
+    printf("MBC ram size: %02x (%02x banks)\n", mbc_ram_banks * 1024 * 8, mbc_ram_banks);
+    uint32_t cart_ram = mbc_type == 2 ? 512 : mbc_ram_banks * 0x2000;
+    if(cart_ram)
+        ram_size = cart_ram;
+    if(!rom_file)
+        return;
+    static const uint8_t battery_types[] = {0x03, 0x06, 0x09, 0x0D, 0x0F, 0x10, 0x13, 0x1B, 0x1E, 0x22, 0xFF};
+    if(ram_saved && cart_ram && memchr(battery_types, mbc_type_id, sizeof(battery_types)))
+        map_save(rom_file);
+    rom_side_path(state_filename, sizeof(state_filename), rom_file, ".state");
+}
+
+// Input movies. A movie is the state it starts from and the input changes, each stored as the
+// cpu cycle it happened at and the new input mask. Input is only taken between runs of
+// CYCLES_PR_FRAME, so a replay from the same state sees every change at the same point.
+#define MOVIE_MAGIC 0x56534547 // GESV
+#define MOVIE_VERSION 1
+struct MovieEvent {
+    uint64_t cycle;
+    uint8_t mask;
+};
+const char* movie_filename = NULL;      // replayed
+const char* movie_out_filename = NULL;  // recorded
+MovieEvent* movie_events = NULL;
+uint32_t movie_count = 0;
+uint32_t movie_capacity = 0;
+uint32_t movie_next = 0;                // next event to replay
+uint8_t movie_mask = 0;                 // input the replay holds
+uint8_t* movie_state = NULL;
+uint32_t movie_state_len = 0;
+uint64_t movie_start_cycle = 0;
+uint64_t movie_end = 0;                 // cpu_cycles when the recording stopped
+
+// Recording starts over from the current state
+void movie_start()
+{
+    if(!movie_state)
+        movie_state = (uint8_t*)malloc(sizeof(state_packed));
+    movie_state_len = state_write(movie_state);
+    movie_start_cycle = cpu_cycles;
+    movie_count = 0;
+}
+
+// Called with the input for the run about to start. Runs after a rewind or an earlier state
+// replace what was recorded from there on.
+void movie_record(uint8_t mask)
+{
+    while(movie_count && movie_events[movie_count - 1].cycle >= cpu_cycles)
+        movie_count--;
+    if(mask == (movie_count ? movie_events[movie_count - 1].mask : 0))
+        return;
+    if(movie_count == movie_capacity) {
+        movie_capacity = movie_capacity ? movie_capacity * 2 : 4096;
+        movie_events = (MovieEvent*)realloc(movie_events, movie_capacity * sizeof(MovieEvent));
+    }
+    movie_events[movie_count].cycle = cpu_cycles;
+    movie_events[movie_count].mask = mask;
+    movie_count++;
+}
+
+// Header, starting state, then each event as the cycles since the last one in 7-bit groups,
+// low first with the top bit set on all but the last, and the mask
+void movie_save(const char* filename)
+{
+    FILE* f = fopen(filename, "wb");
+    if(!f) {
+        printf("Failed to write movie %s\n", filename);
+        return;
+    }
+    uint32_t header[6] = { MOVIE_MAGIC, MOVIE_VERSION, (uint32_t)(cpu_cycles - movie_start_cycle),
+        (uint32_t)((cpu_cycles - movie_start_cycle) >> 32), movie_count, movie_state_len };
+    fwrite(header, sizeof(header), 1, f);
+    fwrite(movie_state, movie_state_len, 1, f);
+    uint64_t last = movie_start_cycle;
+    for(uint32_t i = 0; i < movie_count; i++) {
+        uint64_t delta = movie_events[i].cycle - last;
+        last = movie_events[i].cycle;
+        for(; delta >= 0x80; delta >>= 7)
+            fputc((int)(delta & 0x7F) | 0x80, f);
+        fputc((int)delta, f);
+        fputc(movie_events[i].mask, f);
+    }
+    fclose(f);
+    printf("Recorded movie %s (%u input changes, %u frames)\n", filename, movie_count,
+        (uint32_t)((cpu_cycles - movie_start_cycle) / 70224));
+}
+
+// Loads a movie and its starting state
+bool movie_load(const char* filename)
+{
+    FILE* f = fopen(filename, "rb");
+    uint32_t header[6] = {};
+    if(!f || fread(header, sizeof(header), 1, f) != 1 || header[0] != MOVIE_MAGIC || header[1] != MOVIE_VERSION ||
+       header[5] > sizeof(state_packed) || fread(state_packed, header[5], 1, f) != 1 || !state_read(state_packed, header[5])) {
+        printf("Movie %s is not a version %u movie of this rom\n", filename, MOVIE_VERSION);
+        if(f)
+            fclose(f);
+        return false;
+    }
+    // Events take at least two bytes each
+    long events_at = ftell(f);
+    fseek(f, 0, SEEK_END);
+    long events_size = ftell(f) - events_at;
+    fseek(f, events_at, SEEK_SET);
+    movie_count = movie_capacity = header[4];
+    movie_events = (uint64_t)movie_count * 2 <= (uint64_t)events_size ?
+        (MovieEvent*)malloc(movie_count * sizeof(MovieEvent) + 1) : NULL;
+    uint64_t cycle = cpu_cycles;
+    bool complete = movie_events != NULL;
+    for(uint32_t i = 0; complete && i < movie_count; i++) {
+        uint64_t delta = 0;
+        int c = 0x80;
+        for(int shift = 0; c & 0x80 && complete; shift += 7) {
+            c = fgetc(f);
+            complete = c != EOF && shift < 64;
+            delta |= (uint64_t)(c & 0x7F) << shift;
+        }
+        c = fgetc(f);
+        complete = complete && c != EOF;
+        cycle += delta;
+        movie_events[i].cycle = cycle;
+        movie_events[i].mask = c;
+    }
+    fclose(f);
+    if(!complete) {
+        printf("Movie %s is cut short\n", filename);
+        free(movie_events);
+        movie_events = NULL;
+        movie_count = movie_capacity = 0;
+        return false;
+    }
+    movie_end = cpu_cycles + ((uint64_t)header[3] << 32 | header[2]);
+    printf("Playing movie %s (%u input changes, %u frames)\n", filename, movie_count, (uint32_t)((movie_end - cpu_cycles) / 70224));
+    return true;
+}
+
+// Rewind. A snapshot is kept for every frame in a ring of coded snapshots within a memory
+// budget. Every REWIND_KEY_EVERY frames one is coded against zeros as a keyframe, the others
+// against their keyframe, so any frame decodes from two entries. The oldest keyframes are
+// dropped with their frames when the ring needs room. With the ppu thread, snapshots leave out
+// the frame being drawn so the thread isn't stopped every frame; after a step back, the lines
+// already drawn that frame keep what the thread drew last until the next frame.
+#define REWIND_ENTRIES 0x10000  // power of two
+#define REWIND_KEY_EVERY 60
+struct RewindEntry {
+    uint32_t offset, len;
+    bool key;
+};
+RewindEntry rewind_entries[REWIND_ENTRIES];
+uint32_t rewind_head = 0;       // entries [tail, head) are kept, counting up
+uint32_t rewind_tail = 0;
+uint8_t* rewind_buf = NULL;
+uint32_t rewind_size = 32 << 20;
+uint32_t rewind_write = 0;      // where the next entry goes in rewind_buf
+uint64_t rewind_key[STATE_MAX / 8];
+uint32_t rewind_key_id = 0;     // entry rewind_key holds
+bool rewind_key_valid = false;
+bool rewinding = false;
+bool rewind_muted = false;
+
+RewindEntry& rewind_entry(uint32_t i)
+{
+    return rewind_entries[i & (REWIND_ENTRIES - 1)];
+}
+
+// Drops the oldest keyframe and the frames coded against it
+void rewind_drop()
+{
+    rewind_tail++;
+    while(rewind_tail != rewind_head && !rewind_entry(rewind_tail).key)
+        rewind_tail++;
+}
+
+void rewind_push()
+{
+    state_capture(state_raw, !ppu_thread);
+    bool key = !rewind_key_valid || rewind_key_id < rewind_tail || rewind_key_id >= rewind_head ||
+        rewind_head - rewind_key_id >= REWIND_KEY_EVERY;
+    uint32_t len = state_encode(state_raw, key ? state_zero : rewind_key, state_words, state_packed);
+    if(len > rewind_size)
+        return;
+    if(rewind_write + len > rewind_size)
+        rewind_write = 0;
+    while(rewind_tail != rewind_head) {
+        RewindEntry& e = rewind_entry(rewind_tail);
+        bool overlaps = e.offset < rewind_write + len && rewind_write < e.offset + e.len;
+        if(!overlaps && rewind_head - rewind_tail < REWIND_ENTRIES)
+            break;
+        rewind_drop();
+    }
+    if(!key && rewind_key_id < rewind_tail)
+        return; // the keyframe went to make room
+    memcpy(rewind_buf + rewind_write, state_packed, len);
+    RewindEntry& e = rewind_entry(rewind_head);
+    e.offset = rewind_write;
+    e.len = len;
+    e.key = key;
+    if(key) {
+        memcpy(rewind_key, state_raw, state_words * 8);
+        rewind_key_id = rewind_head;
+        rewind_key_valid = true;
+    }
+    rewind_head++;
+    rewind_write += len;
+}
+
+// Restores the newest frame and removes it, except the oldest which stays put
+void rewind_pop()
+{
+    if(rewind_head == rewind_tail)
+        return;
+    uint32_t i = rewind_head - 1, k = i;
+    while(k != rewind_tail && !rewind_entry(k).key)
+        k--;
+    RewindEntry& key = rewind_entry(k);
+    RewindEntry& e = rewind_entry(i);
+    if(!rewind_key_valid || rewind_key_id != k) {
+        rewind_key_valid = key.key && state_decode(rewind_buf + key.offset, key.len, state_zero, rewind_key, state_words);
+        rewind_key_id = k;
+        if(!rewind_key_valid) {
+            rewind_tail = rewind_head;
+            return;
+        }
+    }
+    if(i != k && !state_decode(rewind_buf + e.offset, e.len, rewind_key, state_raw, state_words))
+        return;
+    state_restore(i != k ? state_raw : rewind_key, !ppu_thread);
+    if(rewind_head - rewind_tail > 1) {
+        rewind_head--;
+        rewind_write = e.offset;
+    }
+}
+
+// Input mask for frame n of a script of hex masks, each optionally repeated: "10*30 00*5 01".
+// The high nibble is Select/Start/B/A, the low one Down/Up/Left/Right. The last mask is held.
+uint8_t input_mask(const char* script, uint32_t n)
+{
+    uint8_t mask = 0;
+    const char* p = script + strspn(script, " \t");
+    while(*p) {
+        char* q;
+        uint8_t m = strtoul(p, &q, 16);
+        if(q == p)
+            break;
+        uint32_t count = 1;
+        if(*q == '*')
+            count = strtoul(q + 1, &q, 10);
+        mask = m;
+        if(n < count)
+            break;
+        n -= count;
+        p = q + strspn(q, " \t");
+    }
+    return mask;
+}
+
+// Returns in each branch, and in the parent once all branches are done
+void branch_run()
+{
+    if(!headless || ppu_thread || rec_file) {
+        printf("--branch needs --headless, without --ppu-thread or --record\n");
+        exit(1);
+    }
+    FILE* f = fopen(branch_filename, "r");
+    if(!f) {
+        printf("Failed to open %s\n", branch_filename);
+        exit(1);
+    }
+    static char* scripts[BRANCH_MAX];
+    uint32_t n = 0;
+    char line[4096];
+    while(n < BRANCH_MAX && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "#\r\n")] = 0;
+        if(line[strspn(line, " \t")])
+            scripts[n++] = strdup(line);
+    }
+    fclose(f);
+
+    // Branches get a private copy of cartridge ram, the .sav file is left alone
+    if(ram != ram_static) {
+        memcpy(ram_static, ram, ram_size);
+        munmap(ram, ram_size);
+        ram = ram_static;
+        mbc_remap();
+    }
+    RunResult* results = (RunResult*)mmap(NULL, (n + 1) * sizeof(RunResult), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(results == MAP_FAILED) {
+        printf("Failed to map branch results\n");
+        exit(1);
+    }
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if(jobs < 1)
+        jobs = 1;
+    fflush(NULL);
+    uint64_t start = SDL_GetPerformanceCounter();
+    uint32_t next = 0, active = 0;
+    while(next < n || active) {
+        if(next < n && active < jobs) {
+            pid_t pid = fork();
+            if(pid == 0) {
+                input_script = scripts[next];
+                input_start = lcd_frame_count;
+                run_result = &results[next];
+                run_end = max_frames = lcd_frame_count + branch_frames;
+                hash_file = NULL;
+                wav_file = NULL;
+                audio_hash_file = NULL;
+                apu_capturing = apu_exact_rate = apu_output = false;
+                shm = NULL;
+                link_fd = -1;
+                expect_frame = 0;
+                return;
+            }
+            if(pid < 0) {
+                printf("Failed to start branch %u\n", next);
+                exit(1);
+            }
+            next++;
+            active++;
+        }
+        else if(wait(NULL) > 0) {
+            active--;
+        }
+    }
+    for(uint32_t i = 0; i < n; i++) {
+        RunResult& r = results[i];
+        if(!r.done) {
+            printf("branch %u: failed\n", i);
+            continue;
+        }
+        printf("branch %u: frame %u hash %016llx", i, r.frame, (unsigned long long)r.hash);
+        for(uint32_t k = 0; k < branch_peeks; k++)
+            printf(" %04x=%02x", branch_peek[k], r.peek[k]);
+        printf("\n");
+    }
+    printf("Ran %u branches of %u frames in %.2f s, %ld at a time\n", n, branch_frames,
+        (double)(SDL_GetPerformanceCounter() - start) / SDL_GetPerformanceFrequency(), jobs);
+    munmap(results, (n + 1) * sizeof(RunResult));
+    quit = true;
+}
+
+static int batch_longest_first(const void* a, const void* b)
+{
+    return (int)((const BatchJob*)b)->frames - (int)((const BatchJob*)a)->frames;
+}
+
+static int batch_manifest_order(const void* a, const void* b)
+{
+    return (int)((const BatchJob*)a)->index - (int)((const BatchJob*)b)->index;
+}
+
+void batch_write_json_string(FILE* f, const char* str)
+{
+    fputc('"', f);
+    for(; *str; str++) {
+        if(*str == '"' || *str == '\\')
+            fputc('\\', f);
+        fputc(*str, f);
+    }
+    fputc('"', f);
+}
+
+// Returns in each job's process with the job set up to run. The parent writes the report and exits.
+void batch_run(char*& rom_file)
+{
+    FILE* f = fopen(batch_filename, "r");
+    if(!f) {
+        printf("Failed to open %s\n", batch_filename);
+        exit(1);
+    }
+    static BatchJob jobs[BATCH_MAX];
+    uint32_t n = 0;
+    char line[4096];
+    for(int line_no = 1; n < BATCH_MAX && fgets(line, sizeof(line), f); line_no++) {
+        line[strcspn(line, "#\r\n")] = 0;
+        if(!line[strspn(line, " \t")])
+            continue;
+        char rom[1024], hash[32];
+        BatchJob& job = jobs[n];
+        int used = strlen(line);
+        if(sscanf(line, "%1023s %u %31s %n", rom, &job.frames, hash, &used) < 3 || job.frames == 0) {
+            printf("%s:%i: expected rom, frames, hash or -, inputs\n", batch_filename, line_no);
+            exit(1);
+        }
+        job.index = n;
+        job.rom = strdup(rom);
+        job.check = strcmp(hash, "-") != 0;
+        job.expect = strtoull(hash, NULL, 16);
+        job.inputs = strdup(line + used);
+        n++;
+    }
+    fclose(f);
+    qsort(jobs, n, sizeof(BatchJob), batch_longest_first);
+
+    RunResult* results = (RunResult*)mmap(NULL, (n + 1) * sizeof(RunResult), PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(results == MAP_FAILED) {
+        printf("Failed to map batch results\n");
+        exit(1);
+    }
+    long procs = sysconf(_SC_NPROCESSORS_ONLN);
+    if(procs < 1)
+        procs = 1;
+    pid_t* pids = (pid_t*)calloc(procs, sizeof(pid_t));
+    uint32_t* slot_job = (uint32_t*)calloc(procs, sizeof(uint32_t));
+    uint64_t* slot_start = (uint64_t*)calloc(procs, sizeof(uint64_t));
+    uint64_t timer_freq = SDL_GetPerformanceFrequency();
+    fflush(NULL);
+    uint64_t start = SDL_GetPerformanceCounter();
+    uint32_t next = 0, active = 0;
+    while(next < n || active) {
+        if(next < n && active < procs) {
+            long slot = 0;
+            while(pids[slot])
+                slot++;
+            pid_t pid = fork();
+            if(pid == 0) {
+                // Job output would interleave with the others, only the report is printed
+                int null_fd = open("/dev/null", O_WRONLY);
+                dup2(null_fd, 1);
+                close(null_fd);
+                BatchJob& job = jobs[next];
+                rom_file = job.rom;
+                headless = true;
+                ram_saved = false;
+                max_frames = run_end = job.frames;
+                run_result = &results[job.index];
+                input_script = job.inputs;
+                if(job.check) {
+                    expect_frame = job.frames;
+                    expect_hash = job.expect;
+                }
+                return;
+            }
+            if(pid < 0) {
+                printf("Failed to start job %u\n", next);
+                exit(1);
+            }
+            pids[slot] = pid;
+            slot_job[slot] = next;
+            slot_start[slot] = SDL_GetPerformanceCounter();
+            next++;
+            active++;
+            continue;
+        }
+        int status = 0;
+        pid_t pid = wait(&status);
+        if(pid <= 0)
+            continue;
+        for(long slot = 0; slot < procs; slot++) {
+            if(pids[slot] != pid)
+                continue;
+            BatchJob& job = jobs[slot_job[slot]];
+            job.seconds = (double)(SDL_GetPerformanceCounter() - slot_start[slot]) / timer_freq;
+            job.status = status;
+            pids[slot] = 0;
+            active--;
+        }
+    }
+    double seconds = (double)(SDL_GetPerformanceCounter() - start) / timer_freq;
+    qsort(jobs, n, sizeof(BatchJob), batch_manifest_order);
+
+    FILE* report = stdout;
+    if(batch_report_filename) {
+        report = fopen(batch_report_filename, "w");
+        if(!report) {
+            printf("Failed to open %s for the report\n", batch_report_filename);
+            exit(1);
+        }
+    }
+    const char* ext = batch_report_filename ? strrchr(batch_report_filename, '.') : NULL;
+    bool json = ext && strcmp(ext, ".json") == 0;
+    fprintf(report, json ? "[\n" : "rom,frames,status,hash,expected,seconds,speed\n");
+    uint32_t passed = 0, failed = 0;
+    for(uint32_t i = 0; i < n; i++) {
+        BatchJob& job = jobs[i];
+        RunResult& r = results[i];
+        const char* result = WIFSIGNALED(job.status) ? "crash" : !r.done ? "error" :
+            !job.check ? "done" : r.hash == job.expect ? "pass" : "fail";
+        bool ok = strcmp(result, "pass") == 0 || strcmp(result, "done") == 0;
+        passed += ok;
+        failed += !ok;
+        double speed = r.done && job.seconds > 0 ? job.frames / 59.7275 / job.seconds : 0.0;
+        char hash[17] = "", expected[17] = "";
+        if(r.done)
+            snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)r.hash);
+        if(job.check)
+            snprintf(expected, sizeof(expected), "%016llx", (unsigned long long)job.expect);
+        if(json) {
+            fprintf(report, "  {\"rom\": ");
+            batch_write_json_string(report, job.rom);
+            fprintf(report, ", \"frames\": %u, \"status\": \"%s\", \"hash\": \"%s\", \"expected\": \"%s\", \"seconds\": %.3f, \"speed\": %.1f}%s\n",
+                job.frames, result, hash, expected, job.seconds, speed, i + 1 < n ? "," : "");
+        } else {
+            fprintf(report, "%s,%u,%s,%s,%s,%.3f,%.1f\n", job.rom, job.frames, result, hash, expected, job.seconds, speed);
+        }
+    }
+    if(json)
+        fprintf(report, "]\n");
+    if(report != stdout)
+        fclose(report);
+    printf("Ran %u jobs in %.2f s, %ld at a time: %u passed, %u failed\n", n, seconds, procs, passed, failed);
+    exit(failed ? 1 : 0);
+}
+
+bool control_send(int fd, const uint8_t* data, uint32_t len)
+{
+    while(len) {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if(sent <= 0)
+            return false;
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+// Serves one controller, until it disconnects or sends q. Commands are an opcode byte and
+// little-endian arguments; only some reply. All commands that have arrived run before the
+// replies go out, so a controller can send many per round trip.
+//   s u32 n          step n frames            reply u32 frame count
+//   i u8 mask        hold input (as in --branch scripts)
+//   r u16 addr u16 n read memory              reply n bytes
+//   f                copy the frame to <path>.fb, 160x144 pixels as screen[]; reply u32 frame count
+//   w                save state               reply u32 length, state
+//   l u32 n, state   load state               reply u8 1 if loaded
+//   q                quit
+void control_run()
+{
+    if(!headless || ppu_thread) {
+        printf("--control needs --headless, without --ppu-thread\n");
+        exit(1);
+    }
+    char fb_path[sizeof(sockaddr_un::sun_path) + 8];
+    snprintf(fb_path, sizeof(fb_path), "%s.fb", control_path);
+    int fb_fd = open(fb_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    uint32_t* fb = NULL;
+    if(fb_fd >= 0 && ftruncate(fb_fd, sizeof(screen)) == 0)
+        fb = (uint32_t*)mmap(NULL, sizeof(screen), PROT_READ | PROT_WRITE, MAP_SHARED, fb_fd, 0);
+    if(!fb || fb == MAP_FAILED) {
+        printf("Failed to map %s\n", fb_path);
+        exit(1);
+    }
+
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, control_path, sizeof(addr.sun_path) - 1);
+    unlink(control_path);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0 || bind(listener, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(listener, 1) != 0) {
+        printf("Failed to listen on %s\n", control_path);
+        exit(1);
+    }
+    printf("Waiting for a controller on %s\n", control_path);
+    int fd = accept(listener, NULL, NULL);
+    close(listener);
+
+    static uint8_t in[CTRL_BUF], out[CTRL_BUF];
+    uint32_t have = 0;
+    bool serving = fd >= 0;
+    while(serving) {
+        ssize_t got = recv(fd, in + have, CTRL_BUF - have, 0);
+        if(got <= 0)
+            break;
+        have += got;
+        uint32_t used = 0, out_len = 0;
+        while(serving && used < have) {
+            const uint8_t* cmd = in + used;
+            uint32_t left = have - used;
+            uint32_t size = cmd[0] == 's' || cmd[0] == 'l' ? 5 : cmd[0] == 'i' ? 2 : cmd[0] == 'r' ? 5 : 1;
+            if(left < size)
+                break;
+            uint32_t arg = 0;
+            memcpy(&arg, cmd + 1, size - 1);
+            if(cmd[0] == 'l') {
+                if(arg > sizeof(state_packed)) {
+                    serving = false;
+                    break;
+                }
+                size += arg;
+                if(left < size)
+                    break;
+            }
+            switch(cmd[0]) {
+            case 's': {
+                uint32_t target = lcd_frame_count + arg;
+                run_end = target;
+                lcd_compose = lcd_frame_wanted(lcd_frame_count + 1);
+                while(lcd_frame_count != target)
+                    run_cycles(CYCLES_PR_FRAME, target);
+                memcpy(out + out_len, &lcd_frame_count, 4);
+                out_len += 4;
+                break;
+            }
+            case 'i':
+                keys_state = arg >> 4;
+                dpad_state = arg & 0x0F;
+                break;
+            case 'r':
+                for(uint32_t i = 0; i < arg >> 16; i++)
+                    out[out_len++] = peek((uint16_t)(arg + i));
+                break;
+            case 'f':
+                memcpy(fb, screen, sizeof(screen));
+                memcpy(out + out_len, &lcd_frame_count, 4);
+                out_len += 4;
+                break;
+            case 'w': {
+                uint32_t len = state_write(state_packed);
+                memcpy(out + out_len, &len, 4);
+                memcpy(out + out_len + 4, state_packed, len);
+                out_len += 4 + len;
+                break;
+            }
+            case 'l':
+                out[out_len++] = state_read(cmd + 5, arg);
+                break;
+            case 'q':
+                serving = false;
+                break;
+            default:
+                printf("Unknown control command %02x\n", cmd[0]);
+                serving = false;
+                break;
+            }
+            used += size;
+            if(out_len > CTRL_BUF / 2) {
+                serving = serving && control_send(fd, out, out_len);
+                out_len = 0;
+            }
+        }
+        if(out_len && !control_send(fd, out, out_len))
+            break;
+        memmove(in, in + used, have - used);
+        have -= used;
+    }
+    if(fd >= 0)
+        close(fd);
+    unlink(control_path);
+    munmap(fb, sizeof(screen));
+    close(fb_fd);
+    unlink(fb_path);
+}
+
+// Ahead of time compilation. ges-aot walks the code reachable from the entry point and the
+// interrupt and rst vectors, and writes every place a jump, call or return can land as a C++
+// function. Banked code reached from bank 0 is compiled for every bank, as which bank is mapped
+// isn't known. Immediates are folded in, as rom doesn't change. The code is compiled into
+// rom.aot.so, which ges loads with the rom when asked to (--load-aot) and links against its own
+// cpu state, so it only works with the ges that compiled it. ges_build tells builds apart.
+#define AOT_VERSION 2
+const char ges_build[] = __DATE__ " " __TIME__;
+struct AotEntry {
+    uint32_t offset;  // in the rom
+    AotBlock fn;
+};
+struct AotInfo {
+    uint32_t version;
+    uint32_t count;
+    uint64_t rom_hash;
+    char build[32];   // ges_build of the ges that compiled it
+};
+bool aot_enabled = false;
+bool aot_compile_rom = false;
+
+void aot_load(const char* rom_file)
+{
+    char path[1024] = "./";  // dlopen searches the library path for names without a slash
+    rom_side_path(path + 2, sizeof(path) - 2, rom_file, ".aot.so");
+    const char* file = strchr(path + 2, '/') ? path + 2 : path;
+    if(!aot_enabled || break_at != 0xFFFF || access(file, F_OK) != 0)
+        return;
+    void* lib = dlopen(file, RTLD_NOW);
+    if(!lib) {
+        printf("Failed to load %s: %s\n", file, dlerror());
+        return;
+    }
+    const AotEntry* blocks = (const AotEntry*)dlsym(lib, "ges_aot_blocks");
+    const AotInfo* info = (const AotInfo*)dlsym(lib, "ges_aot_info");
+    if(!blocks || !info || info->version != AOT_VERSION || info->rom_hash != xxh64(rom, rom_size) ||
+       strcmp(info->build, ges_build) != 0) {
+        printf("Not using %s, it was compiled for another rom or ges\n", file);
+        dlclose(lib);
+        return;
+    }
+    for(uint32_t i = 0; i < info->count; i++) {
+        AotBlock*& bank = aot_banks[blocks[i].offset >> 14];
+        if(!bank)
+            bank = (AotBlock*)calloc(0x4000, sizeof(AotBlock));
+        bank[blocks[i].offset & 0x3FFF] = blocks[i].fn;
+    }
+    mbc_remap();
+    printf("Loaded %u compiled blocks from %s\n", info->count, file);
+}
+
+// What the compiled code sees of ges
+const char* aot_preamble =
+    "#include <stdint.h>\n"
+    "extern uint16_t AF, BC, DE, HL, SP, PC;\n"
+    "extern uint8_t map[0x10000];\n"
+    "extern bool ime, halted;\n"
+    "extern uint8_t ime_true_pending;\n"
+    "extern uint8_t* rom;\n"
+    "extern uint8_t* rom_bank0;\n"
+    "extern uint8_t* rom_banked;\n"
+    "extern int run_cycles_left;\n"
+    "extern uint32_t lcd_frame_count, run_until_frame;\n"
+    "uint8_t read(uint16_t addr);\n"
+    "void write(uint16_t addr, uint8_t value);\n"
+    "void aot_clock(int cycles);\n"
+    "struct AotNext { AotNext (*fn)(); };\n"
+    "typedef AotNext (*AotBlock)();\n"
+    "struct AotEntry { uint32_t offset; AotBlock fn; };\n"
+    "struct AotInfo { uint32_t version, count; uint64_t rom_hash; char build[32]; };\n"
+    "#define F (*(uint8_t*)&AF)\n"
+    "#define A (*((uint8_t*)&AF + 1))\n"
+    "#define C (*(uint8_t*)&BC)\n"
+    "#define B (*((uint8_t*)&BC + 1))\n"
+    "#define E (*(uint8_t*)&DE)\n"
+    "#define D (*((uint8_t*)&DE + 1))\n"
+    "#define L (*(uint8_t*)&HL)\n"
+    "#define H (*((uint8_t*)&HL + 1))\n"
+    "#define Fz_mask (1 << 7)\n"
+    "#define Fn_mask (1 << 6)\n"
+    "#define Fh_mask (1 << 5)\n"
+    "#define Fc_mask (1 << 4)\n"
+    "#define Fz ((F & Fz_mask) >> 7)\n"
+    "#define Fn ((F & Fn_mask) >> 6)\n"
+    "#define Fh ((F & Fh_mask) >> 5)\n"
+    "#define Fc ((F & Fc_mask) >> 4)\n"
+    "// The interpreter takes over for interrupts, halts, at the end of the run and after a bank switch\n"
+    "#define STOP (run_cycles_left <= 0 || lcd_frame_count == run_until_frame || halted || (ime && (map[0xFFFF] & map[0xFF0F] & 0x1F)))\n"
+    "#define EXIT(pc) { PC = pc; return AotNext{0}; }\n"
+    "#define GOTO(pc, block, moved) { PC = pc; return AotNext{STOP || moved ? 0 : block}; }\n";
+
+uint8_t* aot_entry = NULL;    // per rom byte: a block starts here
+uint8_t* aot_scanned = NULL;  // per rom byte: an instruction starts here
+uint32_t* aot_work = NULL;
+uint32_t aot_work_count = 0;
+
+uint32_t aot_length(uint8_t op)
+{
+    static const uint8_t op3[] = { 0x01, 0x11, 0x21, 0x31, 0x08, 0xC2, 0xC3, 0xC4, 0xCA, 0xCC, 0xCD, 0xD2, 0xD4, 0xDA, 0xDC, 0xEA, 0xFA };
+    static const uint8_t op2[] = { 0x18, 0x20, 0x28, 0x30, 0x38, 0xC6, 0xCE, 0xD6, 0xDE, 0xE6, 0xEE, 0xF6, 0xFE, 0xE0, 0xF0, 0xE8, 0xF8, 0xCB };
+    if(memchr(op3, op, sizeof(op3)))
+        return 3;
+    if(memchr(op2, op, sizeof(op2)) || (op & 0xC7) == 0x06)
+        return 2;
+    return 1;
+}
+
+// Left to the interpreter: invalid opcodes, halt and stop
+bool aot_interpreted(uint8_t op)
+{
+    static const uint8_t ops[] = { 0xD3, 0xDB, 0xDD, 0xE3, 0xE4, 0xEB, 0xEC, 0xED, 0xF4, 0xFC, 0xFD, 0x76, 0x10 };
+    return memchr(ops, op, sizeof(ops)) != NULL;
+}
+
+// The rom offset cpu address addr has in code from bank k, or -1 if it isn't in rom
+int64_t aot_offset(uint32_t k, uint16_t addr)
+{
+    if(addr >= 0x8000 || (addr >= 0x4000 && k == 0))
+        return -1;
+    int64_t o = addr < 0x4000 ? addr : k * 0x4000 + addr - 0x4000;
+    return o < rom_size ? o : -1;
+}
+
+void aot_add(int64_t o)
+{
+    if(o >= 0 && !aot_entry[o]) {
+        aot_entry[o] = 1;
+        aot_work[aot_work_count++] = o;
+    }
+}
+
+// Jumps from bank 0 into the banked window can land in any bank
+void aot_add_target(uint32_t k, uint16_t addr)
+{
+    if(k == 0 && addr >= 0x4000 && addr < 0x8000) {
+        for(uint32_t b = 1; b * 0x4000 < rom_size; b++)
+            aot_add(aot_offset(b, addr));
+    } else {
+        aot_add(aot_offset(k, addr));
+    }
+}
+
+// Follows the code from a block entry, adding the places it can continue at
+void aot_scan(uint32_t o)
+{
+    uint32_t k = o >> 14;
+    uint16_t addr = k ? 0x4000 + (o & 0x3FFF) : o;
+    while(!aot_scanned[o]) {
+        aot_scanned[o] = 1;
+        uint8_t op = rom[o];
+        uint32_t len = aot_length(op);
+        if((o & 0x3FFF) + len > 0x4000 || o + len > rom_size)
+            return;
+        uint16_t next = addr + len;
+        uint16_t imm = len == 3 ? rom[o + 1] | rom[o + 2] << 8 : rom[o + 1];
+        if(aot_interpreted(op)) {
+            if(op == 0x76 || op == 0x10)
+                aot_add_target(k, addr + 1);
+            return;
+        }
+        if(op == 0x18 || (op & 0xE7) == 0x20)
+            aot_add_target(k, next + (int8_t)imm);
+        if(op == 0xC3 || op == 0xCD || (op & 0xE7) == 0xC2 || (op & 0xE7) == 0xC4)
+            aot_add_target(k, imm);
+        if((op & 0xC7) == 0xC7)
+            aot_add_target(k, op & 0x38);
+        if(op == 0xCD || (op & 0xE7) == 0xC4 || (op & 0xC7) == 0xC7 || op == 0xFB)
+            aot_add_target(k, next); // returned to, or where the interpreter runs after ei
+        if(op == 0xC3 || op == 0x18 || op == 0xC9 || op == 0xD9 || op == 0xE9 || op == 0xCD || (op & 0xC7) == 0xC7 || op == 0xFB)
+            return;
+        o += len;
+        addr = next;
+        if((o & 0x3FFF) == 0) {
+            aot_add_target(k, next);
+            return;
+        }
+    }
+}
+
+// Jump to addr, straight into its block when it is compiled and in the same bank
+void aot_goto(FILE* f, uint32_t k, uint16_t addr, const char* bank_check)
+{
+    int64_t o = addr < 0x4000 ? (k == 0 ? addr : -1) : aot_offset(k, addr);
+    if(o >= 0 && aot_entry[o])
+        fprintf(f, "GOTO(0x%04x, b%06x, %s)", addr, (uint32_t)o, bank_check);
+    else
+        fprintf(f, "EXIT(0x%04x)", addr);
+}
+
+// Writes the C++ for the block at rom offset o. Each instruction is the same as in cpu_tick(),
+// followed by aot_clock() and a check whether to go on.
+void aot_block(FILE* f, uint32_t o)
+{
+    static const char* r8[8] = { "B", "C", "D", "E", "H", "L", NULL, "A" };
+    static const char* r16[4] = { "BC", "DE", "HL", "SP" };
+    static const char* r16stk[4] = { "BC", "DE", "HL", "AF" };
+    static const char* cond[4] = { "!Fz", "Fz", "!Fc", "Fc" };
+    uint32_t k = o >> 14;
+    uint16_t addr = k ? 0x4000 + (o & 0x3FFF) : o;
+    char bank_check[64];
+    snprintf(bank_check, sizeof(bank_check), k ? "rom_banked != rom + 0x%x" : "rom_bank0 != rom", k * 0x4000);
+    fprintf(f, "static AotNext b%06x()\n{\n", o);
+    for(bool first = true;; first = false) {
+        uint8_t op = rom[o];
+        uint32_t len = aot_length(op);
+        if((o & 0x3FFF) + len > 0x4000 || o + len > rom_size || aot_interpreted(op)) {
+            fprintf(f, "    EXIT(0x%04x);\n}\n\n", addr);
+            return;
+        }
+        if(!first && aot_entry[o]) {
+            fprintf(f, "    return b%06x();\n}\n\n", o);
+            return;
+        }
+        uint16_t next = addr + len;
+        uint8_t n = rom[o + 1];
+        uint16_t nn = len == 3 ? rom[o + 1] | rom[o + 2] << 8 : n;
+        int cycles = OP_T_STATES[op];
+        bool rom_write = false;  // may have switched banks
+        bool end = false;        // PC is set, or the block ends after this
+        uint16_t target = 0;
+        const char* taken = NULL;
+        int taken_cycles = 0;
+        const char* src = op & 0x40 && (op & 0x7) == 6 ? NULL : r8[op & 0x7];
+        char v[16];
+        if((op & 0xC7) == 0xC6)
+            snprintf(v, sizeof(v), "0x%02x", n);
+        else
+            snprintf(v, sizeof(v), "%s", src ? src : "read(HL)");
+
+        fprintf(f, "    ");
+        if(op == 0x00) {
+        } else if((op & 0xCF) == 0x1) {
+            fprintf(f, "%s = 0x%04x;", r16[op >> 4], nn);
+        } else if((op & 0xCF) == 0x2 || (op & 0xCF) == 0xA) {
+            const char* reg = (op & 0x30) == 0x00 ? "BC" : (op & 0x30) == 0x10 ? "DE" : "HL";
+            fprintf(f, op & 0x8 ? "A = read(%s);" : "write(%s, A);", reg);
+            fprintf(f, "%s", (op & 0x30) == 0x20 ? " HL++;" : (op & 0x30) == 0x30 ? " HL--;" : "");
+            rom_write = !(op & 0x8);
+        } else if(op == 0x08) {
+            fprintf(f, "write(0x%04x, SP & 0xFF); write(0x%04x, SP >> 8);", nn, (uint16_t)(nn + 1));
+            rom_write = nn < 0x8000 || nn == 0xFFFF;
+        } else if(op == 0xC9 || op == 0xD9) {
+            fprintf(f, "PC = read(SP++); PC |= read(SP++) << 8;%s", op == 0xD9 ? " ime = true;" : "");
+            end = true;
+        } else if((op & 0xE7) == 0xC0) {
+            fprintf(f, "if(%s) { PC = read(SP++); PC |= read(SP++) << 8; aot_clock(%d); return AotNext{0}; }", cond[(op >> 3) & 3], cycles + 12);
+        } else if((op & 0xE7) == 0xC2 || (op & 0xE7) == 0x20) {
+            taken = cond[(op >> 3) & 3];
+            taken_cycles = cycles + 4;
+            target = op & 0x80 ? nn : (uint16_t)(next + (int8_t)n);
+        } else if(op == 0xC3 || op == 0x18) {
+            target = op == 0xC3 ? nn : (uint16_t)(next + (int8_t)n);
+            end = true;
+        } else if(op == 0xE9) {
+            fprintf(f, "PC = HL;");
+            end = true;
+        } else if((op & 0xE7) == 0xC4) {
+            taken = cond[(op >> 3) & 3];
+            taken_cycles = cycles + 12;
+            target = nn;
+        } else if(op == 0xCD || (op & 0xC7) == 0xC7) {
+            fprintf(f, "write(--SP, 0x%02x); write(--SP, 0x%02x);", next >> 8, next & 0xFF);
+            target = op == 0xCD ? nn : op & 0x38;
+            end = true;
+        } else if((op & 0xCF) == 0xC1) {
+            const char* reg = r16stk[(op >> 4) & 3];
+            fprintf(f, "%s = read(SP++); %s |= read(SP++) << 8;%s", reg, reg, reg[0] == 'A' ? " F &= 0xF0;" : "");
+        } else if((op & 0xCF) == 0xC5) {
+            const char* reg = r16stk[(op >> 4) & 3];
+            fprintf(f, "write(--SP, %s >> 8); write(--SP, %s & 0xFF);", reg, reg);
+            rom_write = true;
+        } else if((op & 0xC7) == 0x06) {
+            if(r8[op >> 3])
+                fprintf(f, "%s = 0x%02x;", r8[op >> 3], n);
+            else
+                fprintf(f, "write(HL, 0x%02x);", n);
+            rom_write = !r8[op >> 3];
+        } else if((op & 0xC0) == 0x40) {
+            const char* dst = r8[(op >> 3) & 7];
+            if(dst)
+                fprintf(f, "%s = %s;", dst, src ? src : "read(HL)");
+            else
+                fprintf(f, "write(HL, %s);", src);
+            rom_write = !dst;
+        } else if(op == 0xE2 || op == 0xE0 || op == 0xEA) {
+            if(op == 0xE2)
+                fprintf(f, "write(0xFF00 + C, A);");
+            else
+                fprintf(f, "write(0x%04x, A);", op == 0xE0 ? 0xFF00 + n : nn);
+            rom_write = op == 0xEA && nn < 0x8000;
+        } else if(op == 0xE8 || op == 0xF8) {
+            fprintf(f, "{ int8_t imm = (int8_t)0x%02x; uint16_t r = SP + imm; "
+                "F = (((SP ^ imm ^ r) & 0x10) ? Fh_mask : 0) | (((SP ^ imm ^ r) & 0x100) ? Fc_mask : 0); %s = r; }",
+                n, op == 0xE8 ? "SP" : "HL");
+        } else if(op == 0xF2 || op == 0xF0 || op == 0xFA) {
+            if(op == 0xF2)
+                fprintf(f, "A = read(0xFF00 + C);");
+            else
+                fprintf(f, "A = read(0x%04x);", op == 0xF0 ? 0xFF00 + n : nn);
+        } else if(op == 0xF9) {
+            fprintf(f, "SP = HL;");
+        } else if((op & 0xCF) == 0x3 || (op & 0xCF) == 0xB) {
+            fprintf(f, "%s%s;", op & 0x8 ? "--" : "++", r16[op >> 4]);
+        } else if((op & 0xCF) == 0x9) {
+            fprintf(f, "{ uint32_t r = %s + HL; F = (Fz?Fz_mask:0) | 0 | ((r&0xFFFF0000)?Fc_mask:0) | (((r ^ HL ^ %s) & 0x1000) ? Fh_mask : 0); HL = r; }",
+                r16[op >> 4], r16[op >> 4]);
+        } else if((op & 0xC7) == 0x4 || (op & 0xC7) == 0x5) {
+            const char* reg = r8[op >> 3];
+            fprintf(f, "{ uint8_t v = %s; ", reg ? reg : "read(HL)");
+            if(op & 1)
+                fprintf(f, "v -= 1; F = (v == 0 ? Fz_mask : 0) | Fn_mask | ((v & 0xF) == 0xF ? Fh_mask : 0) | (F & Fc_mask); ");
+            else
+                fprintf(f, "v += 1; F = (v == 0 ? 0x80 : 0) | ((v & 0xF) == 0 ? 0x20 : 0) | (F & Fc_mask); ");
+            if(reg)
+                fprintf(f, "%s = v; }", reg);
+            else
+                fprintf(f, "write(HL, v); }");
+            rom_write = !reg;
+        } else if(op == 0xCB) {
+            static const char* shifts[8] = {
+                "r = (v << 1) | (v >> 7); F = (r == 0 ? Fz_mask : 0) | (v & 0x80 ? Fc_mask : 0);",
+                "r = (v >> 1) | (v << 7); F = (r == 0 ? Fz_mask : 0) | (v & 1 ? Fc_mask : 0);",
+                "r = (v << 1) | Fc; F = (r == 0 ? Fz_mask : 0) | (v & 0x80 ? Fc_mask : 0);",
+                "r = (v >> 1) | (Fc << 7); F = (r == 0 ? Fz_mask : 0) | (v & 1 ? Fc_mask : 0);",
+                "r = (v << 1); F = (r == 0 ? Fz_mask : 0) | (v & 0x80 ? Fc_mask : 0);",
+                "r = (v >> 1) | (v & 0x80); F = (r == 0 ? Fz_mask : 0) | (v & 1 ? Fc_mask : 0);",
+                "r = (v >> 4) | (v << 4); F = (r == 0 ? Fz_mask : 0);",
+                "r = v >> 1; F = (r == 0 ? Fz_mask : 0) | (v & 1 ? Fc_mask : 0);" };
+            const char* reg = r8[n & 7];
+            uint8_t top = n >> 6, bit = (n >> 3) & 7;
+            cycles = (n & 0x7) != 0x6 ? 8 : (n & 0xC0) == 0x40 ? 12 : 16;
+            fprintf(f, "{ uint8_t v = %s; ", reg ? reg : "read(HL)");
+            if(top == 1)
+                fprintf(f, "F = (((1<<%d)&v) ? 0 : Fz_mask) | 0 | 0x20 | (F&Fc_mask); }", bit);
+            else if(top)
+                fprintf(f, top == 2 ? "v &= ~(1<<%d); " : "v |= (1<<%d); ", bit);
+            else
+                fprintf(f, "uint8_t r = 0; %s ", shifts[bit]);
+            if(top != 1) {
+                const char* result = top ? "v" : "r";
+                if(reg)
+                    fprintf(f, "%s = %s; }", reg, result);
+                else
+                    fprintf(f, "write(HL, %s); }", result);
+            }
+            rom_write = !reg && top != 1;
+        } else if((op & 0xC0) == 0x80 || (op & 0xC7) == 0xC6) {
+            static const char* alu[8] = {
+                "uint32_t r = A + v; F = ((r & 0xFF) == 0 ? 0x80 : 0) | 0 | (((A ^ v ^ r) & 0x10) << 1) | ((r & 0xFF00) ? 0x10 : 0); A = r & 0xFF;",
+                "uint32_t r = A + v + Fc; F = ((r & 0xFF) == 0 ? 0x80 : 0) | 0 | (((A ^ v ^ r) & 0x10) << 1) | ((r & 0xFF00) ? 0x10 : 0); A = r & 0xFF;",
+                "uint32_t r = A - v; F = ((r & 0xFF) == 0 ? 0x80 : 0) | Fn_mask | (((A ^ v ^ r) & 0x10) << 1) | ((r & 0xFF00) ? 0x10 : 0); A = r & 0xFF;",
+                "uint32_t r = A - v - Fc; F = ((r & 0xFF) == 0 ? 0x80 : 0) | Fn_mask | (((A ^ v ^ r) & 0x10) << 1) | ((r & 0xFF00) ? 0x10 : 0); A = r & 0xFF;",
+                "A = A & v; F = (A == 0 ? 0x80 : 0) | 0 | 0x20 | 0;",
+                "A = A ^ v; F = (A == 0 ? 0x80 : 0) | 0 | 0 | 0;",
+                "A = A | v; F = (A == 0 ? 0x80 : 0) | 0 | 0 | 0;",
+                "uint32_t r = A - v; F = ((r & 0xFF) == 0 ? 0x80 : 0) | Fn_mask | (((A ^ v ^ r) & 0x10) << 1) | ((r & 0xFF00) ? 0x10 : 0);" };
+            fprintf(f, "{ uint8_t v = %s; %s }", v, alu[(op >> 3) & 7]);
+        } else if(op == 0x07) {
+            fprintf(f, "A = (A << 1) | (A >> 7); F = A & 1 ? Fc_mask : 0;");
+        } else if(op == 0x0F) {
+            fprintf(f, "A = (A >> 1) | (A << 7); F = A & 0x80 ? Fc_mask : 0;");
+        } else if(op == 0x17) {
+            fprintf(f, "{ uint8_t r = (A << 1) | Fc; F = A & 0x80 ? Fc_mask : 0; A = r; }");
+        } else if(op == 0x1F) {
+            fprintf(f, "{ uint8_t r = (A >> 1) | (Fc << 7); F = A & 1 ? Fc_mask : 0; A = r; }");
+        } else if(op == 0x27) {
+            fprintf(f, "{ uint8_t adj = 0; if(Fn) { if(Fh) adj+=0x6; if(Fc) adj+=0x60; A-=adj; } "
+                "else { if(Fh || (A&0xF) > 0x9) adj+=0x6; if(Fc || A>0x99) adj+=0x60, F|=Fc_mask; A += adj; } "
+                "F &= ~(Fz_mask | Fh_mask); F |= (A == 0 ? Fz_mask : 0); }");
+        } else if(op == 0x2F) {
+            fprintf(f, "A = ~A; F |= Fn_mask | Fh_mask;");
+        } else if(op == 0x37) {
+            fprintf(f, "F &= ~ (Fn_mask | Fh_mask); F |= Fc_mask;");
+        } else if(op == 0x3F) {
+            fprintf(f, "F &= ~ (Fn_mask | Fh_mask); F ^= Fc_mask;");
+        } else if(op == 0xF3) {
+            fprintf(f, "ime = false;");
+        } else if(op == 0xFB) {
+            fprintf(f, "ime_true_pending = 1;");
+        }
+
+        if(taken) {
+            fprintf(f, "if(%s) { ", taken);
+            if((op & 0xE7) == 0xC4)
+                fprintf(f, "write(--SP, 0x%02x); write(--SP, 0x%02x); ", next >> 8, next & 0xFF);
+            fprintf(f, "aot_clock(%d); ", taken_cycles);
+            aot_goto(f, k, target, bank_check);
+            fprintf(f, " }");
+        }
+        fprintf(f, "\n    aot_clock(%d);\n", cycles);
+        if(end && (op == 0xC3 || op == 0x18 || op == 0xCD || (op & 0xC7) == 0xC7)) {
+            fprintf(f, "    ");
+            aot_goto(f, k, target, bank_check);
+            fprintf(f, "\n}\n\n");
+            return;
+        }
+        if(end) {
+            fprintf(f, "    return AotNext{0};\n}\n\n");
+            return;
+        }
+        if(op == 0xFB) {
+            fprintf(f, "    EXIT(0x%04x);\n}\n\n", next);
+            return;
+        }
+        fprintf(f, "    if(STOP%s%s) EXIT(0x%04x);\n", rom_write ? " || " : "", rom_write ? bank_check : "", next);
+        o += len;
+        addr = next;
+        // The next bank in the rom isn't what follows in the address space
+        if((o & 0x3FFF) == 0) {
+            fprintf(f, "    EXIT(0x%04x);\n}\n\n", addr);
+            return;
+        }
+    }
+}
+
+// ges-aot: writes rom.aot.cpp and compiles it to rom.aot.so
+void aot_compile(const char* rom_file)
+{
+    if(!rom_file) {
+        printf("Usage: ges-aot rom.gb\n");
+        exit(1);
+    }
+    map_rom(rom_file);
+    aot_entry = (uint8_t*)calloc(rom_size, 1);
+    aot_scanned = (uint8_t*)calloc(rom_size, 1);
+    aot_work = (uint32_t*)malloc(rom_size * sizeof(uint32_t));
+    aot_add(0x100);
+    for(uint16_t vector = 0; vector <= 0x60; vector += 8)
+        aot_add(vector);
+    for(uint32_t i = 0; i < aot_work_count; i++)
+        aot_scan(aot_work[i]);
+    // Places that start with something the interpreter runs aren't blocks
+    for(uint32_t o = 0; o < rom_size; o++)
+        if(aot_entry[o] && (aot_interpreted(rom[o]) || (o & 0x3FFF) + aot_length(rom[o]) > 0x4000 || o + aot_length(rom[o]) > rom_size))
+            aot_entry[o] = 0;
+
+    char source[1024], lib[1024];
+    rom_side_path(source, sizeof(source), rom_file, ".aot.cpp");
+    rom_side_path(lib, sizeof(lib), rom_file, ".aot.so");
+    FILE* f = fopen(source, "w");
+    if(!f) {
+        printf("Failed to write %s\n", source);
+        exit(1);
+    }
+    fprintf(f, "// Compiled from %s by ges-aot, for the ges that compiled it\n%s\n", rom_file, aot_preamble);
+    for(uint32_t o = 0; o < rom_size; o++)
+        if(aot_entry[o])
+            fprintf(f, "static AotNext b%06x();\n", o);
+    fprintf(f, "\n");
+    uint32_t count = 0;
+    for(uint32_t o = 0; o < rom_size; o++) {
+        if(aot_entry[o]) {
+            aot_block(f, o);
+            count++;
+        }
+    }
+    fprintf(f, "extern \"C\" const AotEntry ges_aot_blocks[] = {\n");
+    for(uint32_t o = 0; o < rom_size; o++)
+        if(aot_entry[o])
+            fprintf(f, "    { 0x%06x, b%06x },\n", o, o);
+    fprintf(f, "};\nextern \"C\" const AotInfo ges_aot_info = { %u, %u, 0x%016llxull, \"%s\" };\n",
+        AOT_VERSION, count, (unsigned long long)xxh64(rom, rom_size), ges_build);
+    fclose(f);
+
+    uint32_t instructions = 0;
+    for(uint32_t o = 0; o < rom_size; o++)
+        instructions += aot_scanned[o];
+    printf("Wrote %u blocks, %u instructions to %s\n", count, instructions, source);
+    const char* cxx = getenv("CXX") ? getenv("CXX") : "c++";
+    char command[4096];
+#ifdef __APPLE__
+    const char* link = " -undefined dynamic_lookup";
+#else
+    const char* link = "";
+#endif
+    snprintf(command, sizeof(command), "%s -O2 -shared -fPIC%s -o '%s' '%s'", cxx, link, lib, source);
+    printf("%s\n", command);
+    int status = system(command);
+    if(status != 0) {
+        printf("Compiling %s failed\n", source);
+        exit(1);
+    }
+    printf("Compiled %s\n", lib);
+    exit(0);
+}
+
+#ifndef GES_LIB
+int main(int argc, char* argv[]) {
+    char* rom_file = NULL;
+    char* boot_rom_file = NULL;
+    char* hash_filename = NULL;
+    char* audio_hash_filename = NULL;
+    char* load_state_filename = NULL;
+    char* save_state_filename = NULL;
+
+    // Started as ges-batch, the first argument is the manifest
+    const char* program = strrchr(argv[0], '/');
+    bool batch_program = strcmp(program ? program + 1 : argv[0], "ges-batch") == 0;
+    aot_compile_rom = strcmp(program ? program + 1 : argv[0], "ges-aot") == 0;
+
+    // Parse command line arguments
+    for(int i = 1; i < argc; i++) {
+        if(strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            CYCLES_PR_FRAME = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            boot_rom_file = argv[++i];
+        } else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            rec_filename = argv[++i];
+        } else if(strcmp(argv[i], "--record-every") == 0 && i + 1 < argc) {
+            rec_every = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if(strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            max_frames = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--frame-hashes") == 0 && i + 1 < argc) {
+            hash_filename = argv[++i];
+        } else if(strcmp(argv[i], "--audio-out") == 0 && i + 1 < argc) {
+            wav_filename = argv[++i];
+        } else if(strcmp(argv[i], "--audio-hashes") == 0 && i + 1 < argc) {
+            audio_hash_filename = argv[++i];
+        } else if(strcmp(argv[i], "--expect-hash") == 0 && i + 1 < argc) {
+            char* colon = NULL;
+            expect_frame = strtoul(argv[++i], &colon, 10);
+            expect_hash = strtoull(*colon == ':' ? colon + 1 : colon, NULL, 16);
+        } else if(strcmp(argv[i], "--load-state") == 0 && i + 1 < argc) {
+            load_state_filename = argv[++i];
+        } else if(strcmp(argv[i], "--save-state") == 0 && i + 1 < argc) {
+            save_state_filename = argv[++i];
+        } else if(strcmp(argv[i], "--rewind-mb") == 0 && i + 1 < argc) {
+            // Up to 2 GB, so offsets in the buffer plus an entry stay within 32 bits
+            char* end = NULL;
+            unsigned long long mb = strtoull(argv[++i], &end, 10);
+            if(*end || argv[i][0] == '-' || mb > 2048) {
+                printf("--rewind-mb must be 0 to 2048\n");
+                return 1;
+            }
+            rewind_size = (uint32_t)mb << 20;
+        } else if(strcmp(argv[i], "--branch") == 0 && i + 1 < argc) {
+            branch_filename = argv[++i];
+        } else if(strcmp(argv[i], "--branch-frames") == 0 && i + 1 < argc) {
+            branch_frames = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--branch-peek") == 0 && i + 1 < argc) {
+            char* p = argv[++i];
+            while(*p && branch_peeks < BRANCH_PEEKS) {
+                branch_peek[branch_peeks++] = strtoul(p, &p, 16);
+                p += strspn(p, ",");
+            }
+        } else if(strcmp(argv[i], "--no-save") == 0) {
+            ram_saved = false;
+        } else if(strcmp(argv[i], "--turbo") == 0) {
+            turbo = true;
+        } else if(strcmp(argv[i], "--ppu-thread") == 0) {
+            ppu_thread = true;
+        } else if(strcmp(argv[i], "-v") == 0) {
+            verbose_logging = true;
+        } else if(strcmp(argv[i], "-br") == 0 && i + 1 < argc) {
+            break_at = (uint16_t)strtol(argv[++i], NULL, 16);
+            printf("Breakpoint set at %04x\n", break_at);
+        } else if(strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_filename = argv[++i];
+        } else if(strcmp(argv[i], "--batch-report") == 0 && i + 1 < argc) {
+            batch_report_filename = argv[++i];
+        } else if(strcmp(argv[i], "--control") == 0 && i + 1 < argc) {
+            control_path = argv[++i];
+        } else if(strcmp(argv[i], "--shm") == 0 && i + 1 < argc) {
+            shm_name = argv[++i];
+        } else if(strcmp(argv[i], "--aot") == 0) {
+            aot_compile_rom = true;
+        } else if(strcmp(argv[i], "--load-aot") == 0) {
+            aot_enabled = true;
+        } else if(strcmp(argv[i], "--link") == 0 && i + 1 < argc) {
+            link_path = argv[++i];
+        } else if(strcmp(argv[i], "--link-quantum") == 0 && i + 1 < argc) {
+            link_quantum = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--movie") == 0 && i + 1 < argc) {
+            movie_filename = argv[++i];
+        } else if(strcmp(argv[i], "--movie-record") == 0 && i + 1 < argc) {
+            movie_out_filename = argv[++i];
+        } else if(batch_program && !batch_filename) {
+            batch_filename = argv[i];
+        } else {
+            rom_file = argv[i];
+        }
+    }
+    if(batch_filename)
+        batch_run(rom_file);
+    if(aot_compile_rom)
+        aot_compile(rom_file);
+
+    uint64_t timer_freq = SDL_GetPerformanceFrequency();
+
+    SDL_Window* window = NULL;
+    SDL_Renderer* renderer = NULL;
+    SDL_AudioDeviceID audio_device = 0;
+    if(!headless) {
+        // Initialize SDL
+        if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+            printf("SDL initialization failed: %s\n", SDL_GetError());
+            return 1;
+        }
+
+        if (SDL_Init(SDL_INIT_AUDIO) < 0) {
+            printf("SDL audio initialization failed: %s\n", SDL_GetError());
+            return 1;
+        }
+
+        // Create window
+        window = SDL_CreateWindow(
+            "Ges emulator",
+            SDL_WINDOWPOS_CENTERED,
+            SDL_WINDOWPOS_CENTERED,
+            //160*SCREENSCALE, 144*SCREENSCALE,
+            240 * SCREENSCALE, 320 * SCREENSCALE,
+            SDL_WINDOW_SHOWN | SDL_WINDOW_INPUT_FOCUS
+        );
+
+        if (!window) {
+            printf("Window creation failed: %s\n", SDL_GetError());
+            SDL_Quit();
+            return 1;
+        }
+
+        SDL_ShowWindow(window);
+        SDL_RaiseWindow(window);
+
+        // Create renderer
+        renderer = SDL_CreateRenderer(
+            window,
+            -1,
+            SDL_RENDERER_ACCELERATED
+        );
+
+        if (!renderer) {
+            printf("Renderer creation failed: %s\n", SDL_GetError());
+            SDL_DestroyWindow(window);
+            SDL_Quit();
+            return 1;
+        }
+
+        // Setup audio
+        SDL_AudioSpec spec = {}, obtained = {};
+        spec.freq = 48000;
+        spec.format = AUDIO_F32SYS;  
+        spec.channels = 2;
+        spec.samples = 128;
+        spec.callback = audio_callback;
+        spec.userdata = NULL;
+        audio_device = SDL_OpenAudioDevice(NULL, 0, &spec, &obtained, 0);
+        if (audio_device == 0) {
+            printf("Failed to open audio: %s\n", SDL_GetError());
+            return 1;
+        }
+        SDL_PauseAudioDevice(audio_device, 0); // Start audio playback
+        apu_playback = true;
+    }
 
     printf("Ges emulator\n");
     printf("Press ESC to quit\n");
 
     // Rom loading
-    memset(rom, 0xff, sizeof(rom));
     if(rom_file) {
         printf("Loading rom %s\n", rom_file);
-        load_rom(rom, sizeof(rom), rom_file);
-        mbc_type_id = rom[0x147];
-        mbc_rom_size_info = rom[0x148];
-        mbc_ram_size_info = rom[0x149];
-        static const uint8_t mbc_type_table[] = {1,1,1,1, 2,2, 0,0,0,0, 3,3,3,3,3, 4,4,4, 5,5,5,5,5,5, 0,0,0,0,0};
-        static const uint8_t mbc_ram_banks_table[] = {0, 0, 1, 4, 16, 8}; // Number of 8KB RAM banks
-        mbc_ram_banks = mbc_ram_banks_table[mbc_ram_size_info];
-        mbc_rom_banks = 2 << mbc_rom_size_info;
-        mbc_type = mbc_type_table[mbc_type_id];
-        printf("MBC type id: %02x\n", mbc_type_id);
-        printf("MBC type: %02x\n", mbc_type);
-        printf("MBC rom size: %02x (%02x banks)\n", mbc_rom_size_info, mbc_rom_banks);
-        printf("MBC ram size: %02x (%02x banks)\n", mbc_ram_banks * 1024 * 8, mbc_ram_banks);
+        map_rom(rom_file);
+        cart_init(rom_file);
+        aot_load(rom_file);
+    }
+    else {
+        rom = (uint8_t*)malloc(0x8000);
+        memset(rom, 0xff, 0x8000);
+        rom_size = 0x8000;
     }
+    mbc_remap();
     if(boot_rom_file) {
         printf("Loading boot-rom %s\n", boot_rom_file);
         load_rom(boot_rom, sizeof(boot_rom), boot_rom_file);
     }
 
+    if(hash_filename) {
+        hash_file = fopen(hash_filename, "w");
+        if(!hash_file) {
+            printf("Failed to open %s for frame hashes\n", hash_filename);
+            return 1;
+        }
+    }
+
+    if(wav_filename) {
+        wav_file = fopen(wav_filename, "wb");
+        if(!wav_file) {
+            printf("Failed to open %s for audio\n", wav_filename);
+            return 1;
+        }
+        setvbuf(wav_file, NULL, _IOFBF, 1 << 20);
+        wav_write_header();
+    }
+    if(audio_hash_filename) {
+        audio_hash_file = fopen(audio_hash_filename, "w");
+        if(!audio_hash_file) {
+            printf("Failed to open %s for audio hashes\n", audio_hash_filename);
+            return 1;
+        }
+    }
+    if(shm_name && !shm_init()) {
+        printf("Failed to create shared memory %s\n", shm_name);
+        return 1;
+    }
+    blip_init();
+    lfsr_init();
+    apu_capturing = wav_file || audio_hash_file || shm;
+    apu_exact_rate = wav_file || audio_hash_file;
+    apu_output = apu_playback || apu_capturing;
+
+    SDL_Thread* rec_writer = NULL;
+    if(rec_filename) {
+        rec_file = fopen(rec_filename, "wb");
+        if(!rec_file) {
+            printf("Failed to open %s for recording\n", rec_filename);
+            return 1;
+        }
+        if(rec_every == 0)
+            rec_every = 1;
+        setvbuf(rec_file, NULL, _IOFBF, 4 << 20);
+        fprintf(rec_file, "YUV4MPEG2 W160 H144 F%u:%u Ip A1:1 C420jpeg\n", 4194304, 70224 * rec_every);
+        rec_free = SDL_CreateSemaphore(REC_POOL_SIZE);
+        rec_full = SDL_CreateSemaphore(0);
+        rec_writer = SDL_CreateThread(rec_thread_main, "recorder", NULL);
+    }
+
+    SDL_Thread* ppu_worker = NULL;
+    if(ppu_thread) {
+        lcd_mem = ppu_mem;
+        lcd_out = ppu_screen;
+        ppu_work = SDL_CreateSemaphore(0);
+        ppu_done = SDL_CreateSemaphore(1);
+        ppu_worker = SDL_CreateThread(ppu_thread_main, "ppu", NULL);
+    }
+
     cpu_boot();
     if(!boot_rom_file)
         post_boot_teleport(); 
+    state_words = state_sync(state_raw, true, true, true);
+    if(load_state_filename && !state_load(load_state_filename))
+        return 1;
+    if(movie_filename && !movie_load(movie_filename))
+        return 1;
+    if(movie_out_filename)
+        movie_start();
+    if(link_path && !link_open()) {
+        printf("Failed to link through %s\n", link_path);
+        return 1;
+    }
+    if(!headless && rewind_size)
+        rewind_buf = (uint8_t*)malloc(rewind_size);
+    if(branch_filename)
+        branch_run();
 
     bool running = true;
 
+    uint64_t run_start = SDL_GetPerformanceCounter();
+    if(control_path) {
+        control_run();
+        running = false;
+    }
     int64_t frame_target = 0;
-    uint64_t target_duration = timer_freq / 59.7275f;
-    while (running) {
+    uint64_t target_duration = timer_freq * CYCLES_PR_FRAME / 4194304; // emulated time runs at the real clock
+    while (running && !quit) {
 
         uint64_t frame_start = SDL_GetPerformanceCounter();
 
-        int cycles_left  = CYCLES_PR_FRAME;
+        if(input_script) {
+            uint8_t mask = input_mask(input_script, lcd_frame_count - input_start);
+            keys_state = mask >> 4;
+            dpad_state = mask & 0x0F;
+        }
 
         // Keyboard handling
         SDL_Event event;
-        while (SDL_PollEvent(&event)) {
+        while (!headless && SDL_PollEvent(&event)) {
             if (event.type == SDL_QUIT) {
                 running = false;
                 continue;
@@ -1410,335 +4609,80 @@ int main(int argc, char* argv[]) {
             
             if(event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_9)
                 upscale = !upscale;
-        }
-
-        // Run cpu
-        while (cycles_left > 0)
-        {
-            int cycles = cpu_tick();
-
-            // Update timers
-            bool apu_tick = false;
-            sys_counter += cycles;
-            uint8_t new_div = sys_counter >> 8;
-            if ((REG_DIV & 0x10) && !(new_div & 0x10)) {
-                // 512hz tick
-                div_apu++;
-                apu_tick = true;
-            }
-            REG_DIV = new_div;
-
-            static uint16_t tima_clock_cycles_table[] = {0x400, 0x10, 0x40, 0x100};
-            if ((REG_TAC & 0x4)) {
-                tima_timer_cycles += cycles;
-                uint16_t cycles = tima_clock_cycles_table[REG_TAC & 0x3];
-                while(tima_timer_cycles >= cycles) {
-                    tima_timer_cycles -= cycles;
-                    // TIMA clock tick
-                    REG_TIMA++;
-                    if(REG_TIMA == 0) {
-                        // Overflow
-                        REG_TIMA = REG_TMA;
-                        REG_IF |= 0x4;
-                    }
-                }
-            }
-
-            // Update serial timer
-            serial_timer += cycles;
-            if(serial_timer >= 512) {
-                serial_timer -= 512;
-                if(REG_SC & 0x80) {
-                    // TODO transfer data
-                    //REG_SC &= ~0x80; // clear transfer flag
-                    //REG_IF |= 0x8;   // request serial interrupt
-                }
-            }
-
-
-
-
-            // Update sound timers
-            if(apu_tick) {
-
-                if(!(REG_NR52 & 0x80)) {
-                    // Sound disabled
-                    continue;
-                }
-
-                if(REG_NR52 & 0x1) {
-                    // Channel 1 length timer
-                    if(sound_ch1_length_enable && (div_apu & 0x1) == 0) {
-                        sound_ch1_length_timer++;
-                        if(sound_ch1_length_timer == 0x40) {
-                            REG_NR52 &= ~0x1; // disable chan 1
-                        }
-                    }
-
-                    // Channel 1 envelope timer
-                    uint8_t ch1_sweep_pace = REG_NR12 & 0x7;
-                    // sweep_pace is at apu/8 = 64hz steps
-                    if(ch1_sweep_pace > 0 && ((div_apu&0x7) == 0) && (++sound_ch1_envelope_timer == ch1_sweep_pace))
-                    {
-                        sound_ch1_envelope_timer = 0;
-                        if(REG_NR12 & 0x8 && sound_ch1_volume < 15) {
-                            sound_ch1_volume++;
-                        } else if (sound_ch1_volume > 0) {
-                            sound_ch1_volume--;
-                        }
-                    }
-
-                    // Channel 1 frequency sweep timer
-                    if(sound_ch1_frq_sweep_enabled) {
-                        sound_ch1_frq_sweep_timer++;
-                        if(sound_ch1_frq_sweep_timer >= ((REG_NR10 & 0x70) >> 2)) {
-                            sound_ch1_frq_sweep_timer = 0;
-                            uint16_t divider_change = sound_ch1_period_divider >> ((REG_NR10&0x7));
-                            if(REG_NR10 & 0x8) {
-                                sound_ch1_period_divider -= divider_change;
-                            } else {
-                                sound_ch1_period_divider += divider_change;
-                                if(sound_ch1_period_divider > 0x7FF) {
-                                    sound_ch1_period_divider = 0x7FF;
-                                    REG_NR52 &= ~0x1; // disable chan 1
-                                }
-                            }
-                            REG_NR13 = sound_ch1_period_divider & 0xFF;
-                            REG_NR14 = (REG_NR14 & 0xF8) | ((sound_ch1_period_divider >> 8) & 0x7);
-                        }
-                    }
-                }
-
-                if(REG_NR52 & 0x2) {
-
-                    // Channel 2 length timer
-                    if(sound_ch2_length_enable && (div_apu & 0x1) == 0) {
-                        sound_ch2_length_timer++;
-                        if(sound_ch2_length_timer == 0x40) {
-                            REG_NR52 &= ~0x2; // disable chan 2
-                        }
-                    }
-
-                    // Channel 2 envelope timer
-                    uint8_t ch2_sweep_pace = REG_NR22 & 0x7;
-                    // sweep_pace is at apu/8 = 64hz steps
-                    if(ch2_sweep_pace > 0 && ((div_apu&0x7) == 0) && (++sound_ch2_envelope_timer == ch2_sweep_pace))
-                    {
-                        sound_ch2_envelope_timer = 0;
-                        if(REG_NR22 & 0x8 && sound_ch2_volume < 15) {
-                            sound_ch2_volume++;
-                        } else if (sound_ch2_volume > 0) {
-                            sound_ch2_volume--;
-                        }
-                    }
-                }
-
-                if(REG_NR52 & 0x4) {
-                    // Channel 3 length timer
-                    if(sound_ch3_length_enable && (div_apu & 0x1) == 0) {
-                        sound_ch3_length_timer++;
-                        if(sound_ch3_length_timer == 0) {
-                            REG_NR52 &= ~0x4;
-                        }
-                    }
-                }
-
-                if(REG_NR52 & 0x8) {
-                    // Channel 4 length timer
-                    if(sound_ch4_length_enable && (div_apu & 0x1) == 0) {
-                        sound_ch4_length_timer++;
-                        if(sound_ch4_length_timer == 0x40) {
-                            REG_NR52 &= ~0x8; // disable chan 4
-                        }
-                    }   
-
-                    // Channel 4 envelope timer
-                    uint8_t ch4_sweep_pace = REG_NR42 & 0x7;
-                    // sweep_pace is at apu/8 = 64hz steps
-                    if(ch4_sweep_pace > 0 && ((div_apu&0x7) == 0) && (++sound_ch4_envelope_timer == ch4_sweep_pace)) {
-                        sound_ch4_envelope_timer = 0;
-                        if(REG_NR42 & 0x8 && sound_ch4_volume < 15) {
-                            sound_ch4_volume++;
-                        } else if (sound_ch4_volume > 0) {
-                            sound_ch4_volume--;
-                        }
-                    }
-                }
-
-            }
 
-            // LCD logic that needs to happen when a scanline is completed
-            lcd_scanline_cycles += cycles; 
-            bool draw_scanline = false;
-            if(lcd_scanline_cycles >= LCD_CYCLES_PER_SCANLINE) {
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_TAB)
+                turbo = true;
+            else if (event.type == SDL_KEYUP && event.key.keysym.sym == SDLK_TAB)
+                turbo = false;
 
-                lcd_scanline_cycles -= LCD_CYCLES_PER_SCANLINE;
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_BACKSPACE)
+                rewinding = rewind_buf != NULL;
+            else if (event.type == SDL_KEYUP && event.key.keysym.sym == SDLK_BACKSPACE)
+                rewinding = false;
 
-                // Start a new scanline
-                REG_LY++;
-                if(REG_LY > LCD_SCANLINES) {
-                    REG_LY=0;
-                    lcd_window_line = 0;
-                }
-
-                // Update stat for LYC match and trigger LYC=LY interrupt if enabled
-                if(REG_LYC == REG_LY) {
-                    REG_STAT |= 4;
-                    // Fire interrupt if enabled
-                    if (REG_STAT & 0x40) {
-                        REG_IF |= 0x2;
-                    }
-                } else {
-                    REG_STAT &= ~4;
-                }
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F5)
+                state_save(state_filename);
+            if (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_F7 && state_load(state_filename) && movie_out_filename)
+                movie_start();
+        }
 
-                // Trigger interrupt if entering vblank
-                if(REG_LY == LCD_HEIGHT) {
-                    // Always request VBlank interrupt
-                    REG_IF |= 0x1; // Request VBlank interrupt
-                    // If STAT mode 1 (vblank) interrupt enabled, request LCD STAT interrupt
-                    if (REG_STAT & 0x10) {
-                        REG_IF |= 0x2;
-                    }
-                }
-                if (REG_LY >= LCD_HEIGHT) {
-                    // VBlank lines
-                    REG_STAT = (REG_STAT & ~3) | 1;
-                }
-                else {
-                    // Visible scanlines all start in mode 2
-                    REG_STAT = (REG_STAT & ~3) | 2;
-                    // If stat mode 2 interrupt enabled, request LCD STAT interrupt
-                    if(REG_STAT & 0x20) {
-                        REG_IF |= 0x2;
-                    }
-                }
+        // Entering or leaving turbo. Audio is dropped while in turbo or rewinding.
+        if(turbo != turbo_active || rewinding != rewind_muted) {
+            if(turbo != turbo_active) {
+                turbo_present_frame = lcd_frame_count;
+                turbo_compose_at = 0;
+                lcd_compose = true;
             }
+            turbo_active = turbo;
+            rewind_muted = rewinding;
+            SDL_PauseAudioDevice(audio_device, turbo || rewinding ? 1 : 0);
+            apu_playback = audio_device && !turbo && !rewinding;
+            apu_output = apu_playback || apu_capturing;
+        }
 
-            // Handle LCD mode transition during scanline (only regular lines)
-            if(REG_LY < LCD_HEIGHT) {
-                if(lcd_scanline_cycles >= 80 && (REG_STAT & 3) == 2) {
-                    // Switch to mode 3
-                    REG_STAT = (REG_STAT & ~3) | 3;
-                    draw_scanline = true; 
-                }
-                else if(lcd_scanline_cycles >= 80 + 172 && (REG_STAT & 3) == 3) {
-                    // Switch to mode 0
-                    REG_STAT = (REG_STAT & ~3) | 0;
-                    // If stat mode 0 interrupt enabled, request LCD STAT interrupt
-                    if (REG_STAT & 0x8) {
-                        REG_IF |= 0x2;
-                    }
-                }
-            }
-            if(draw_scanline) {
+        // Step back a frame, then run it to show it
+        if(rewinding)
+            rewind_pop();
 
-                // Copy to screen from memory for this scanline
-                if(REG_LCDC & 0x1) // BG enabled
-                {
-                    uint8_t* tilemap = (REG_LCDC & 0x8) ? (map + 0x9C00) : (map + 0x9800);
-                    for(int x = 0; x < 160; ++x)
-                    {
-                        uint8_t vx = x + REG_SCX, vy = REG_LY + REG_SCY;
-                        screen[x + REG_LY * 160] = get_tile_pixel(vx >> 3, vx & 0x7, vy >> 3, vy & 0x7, tilemap, REG_BGP);
-                    }
-                }
+        if(movie_filename) {
+            // Seeks both ways, as rewinding and F7 move back in time
+            while(movie_next > 0 && movie_events[movie_next - 1].cycle > cpu_cycles)
+                movie_next--;
+            while(movie_next < movie_count && movie_events[movie_next].cycle <= cpu_cycles)
+                movie_next++;
+            movie_mask = movie_next ? movie_events[movie_next - 1].mask : 0;
+            keys_state = movie_mask >> 4;
+            dpad_state = movie_mask & 0x0F;
+        }
+        if(movie_out_filename)
+            movie_record(keys_state << 4 | dpad_state);
 
-                // Draw window if enabled, in front of bg and overlaps this scanline
-                if((REG_LCDC & 0x20) && (REG_LCDC & 0x1) && (REG_WY <= REG_LY) && (REG_WX <= 166)) {
-                    uint8_t* tilemap = (REG_LCDC & 0x40) ? (map + 0x9C00) : (map + 0x9800);
-                    for(int win_x = 0; win_x < 160; ++win_x)
-                    {
-                        if(win_x + REG_WX < 7) continue; // before screen
-                        int x = win_x + REG_WX - 7;
-                        if(x >= 160) break;
-                        screen[x + REG_LY * 160] = get_tile_pixel(win_x >> 3, win_x & 0x7, lcd_window_line >> 3, lcd_window_line & 0x7, tilemap, REG_BGP);
-                    }
-                    lcd_window_line++;
-                }
+        run_cycles(CYCLES_PR_FRAME, 0xFFFFFFFF);
+        if(rewind_buf && !rewinding)
+            rewind_push();
+        if(movie_filename && cpu_cycles >= movie_end)
+            running = false;
 
-                // Draw sprites if enabled
-                if(REG_LCDC & 0x2) {
+        uint64_t frame_mid = SDL_GetPerformanceCounter();
 
-                    uint8_t sprite_height = (REG_LCDC & 0x4) ? 16 : 8;
-                    // Find (up to 10) sprites on this scanline
-                    uint16_t sprites_on_line[10] = {}; // upper byte = x position, lower byte = sprite index
-                    uint8_t* oam = map + 0xFE00;
-                    int spritecount = 0;
-                    for(int i = 0; i < 40; ++i)
-                    {
-                        uint8_t sprite_y = *oam++; // Y position on screen + 16
-                        uint8_t sprite_x = *oam++; // X position on screen + 8
-                        oam+=2;
-                        if(sprite_y + sprite_height <= 16 || sprite_y >= 160) {
-                            // Not visible
-                            continue;
-                        }
-                        if(REG_LY + 16 >= sprite_y && REG_LY + 16 < sprite_y + sprite_height) {
-                            uint16_t sprite_to_add = (sprite_x << 8) | i;
-                            int place = spritecount;
-                            while(place > 0 && sprites_on_line[place - 1] <= sprite_to_add) {
-                                sprites_on_line[place] = sprites_on_line[place - 1];
-                                place--;
-                            }
-                            sprites_on_line[place] = sprite_to_add;
-                            spritecount++;
-                            if(spritecount == 10)
-                                break;
-                        }
-                    }
-                    // Now draw spritecount sprites on scanline
-                    for(int s = 0; s < spritecount; ++s) {
-
-                        uint8_t sprite_x = sprites_on_line[s] >> 8; // X position on screen + 8
-                        uint8_t sprite_index = sprites_on_line[s] & 0xFF;
-                        uint8_t* oam_entry = map + 0xFE00 + sprite_index * 4;
-                        uint8_t sprite_y = *(oam_entry);     // Y position on screen + 16
-                        uint8_t sprite_tile = *(oam_entry + 2); // Tile index
-                        if(sprite_height == 16)
-                            sprite_tile &= 0xFE; // force even tile number for 8x16 sprites
-                        uint8_t sprite_attr = *(oam_entry+3); // Attributes
-                        bool flip_x = (sprite_attr & 0x20) != 0;
-                        bool flip_y = (sprite_attr & 0x40) != 0;
-                        bool behind_bg = (sprite_attr & 0x80) != 0;
-                        uint8_t palette = (sprite_attr & 0x10) ? REG_OBP1 : REG_OBP0;
-
-                        int line_in_sprite = REG_LY + 16 - sprite_y;
-                        if(flip_y)
-                            line_in_sprite = (sprite_height - 1) - line_in_sprite;
-                        uint8_t* tiledata = map + 0x8000 + sprite_tile * 16 + line_in_sprite * 2;
-
-                        for(int xpix = 0; xpix < 8; ++xpix)
-                        {
-                            int screen_x = sprite_x + xpix - 8;
-                            if(screen_x < 0 || screen_x >= 160)
-                                continue;
-                            int pixel_x_in_sprite = flip_x ? (7 - xpix) : xpix;
-                            uint8_t mask = 0x80 >> pixel_x_in_sprite;
-                            int paletteidx = (*tiledata) & mask ? 1 : 0;
-                            paletteidx += (*(tiledata+1) & mask) ? 2 : 0;
-                            if(paletteidx == 0)
-                                continue; // Transparent pixel
-
-                            // Get color from palette
-                            int color = (palette >> (paletteidx * 2)) & 0x3;
-                            // If behind bg and bg pixel not color 0, skip drawing
-                            if(behind_bg) {
-                                uint32_t bg_pixel = screen[screen_x + REG_LY * 160];
-                                if(bg_pixel != 0x00000000)
-                                    continue;
-                            }
-                            screen[screen_x + REG_LY * 160] = palette_colors[color];
-                        }
-                    }
-                }
-            }
+        if(max_frames && lcd_frame_count >= max_frames)
+            running = false;
+        if(headless)
+            continue;
 
-            cycles_left -= cycles;
+        // In turbo, present about once per refresh, and only a frame that was drawn. Frames
+        // until the one expected to complete at the next refresh are not drawn at all.
+        if(turbo) {
+            frame_target = 0;
+            if(!lcd_frame_ready || frame_mid < turbo_present_at)
+                continue;
+            uint32_t frames = lcd_frame_count - turbo_present_frame;
+            turbo_present_frame = lcd_frame_count;
+            turbo_compose_at = lcd_frame_count + frames - 1;
+            turbo_present_at = frame_mid + target_duration;
+            lcd_frame_ready = false;
         }
 
-        uint64_t frame_mid = SDL_GetPerformanceCounter();
-
         // Clear screen
         uint32_t clearcol = (200<<16)+(220<<8)+200;
         SDL_SetRenderDrawColor(renderer, 200, 220, 200, 255);
@@ -1797,6 +4741,8 @@ int main(int argc, char* argv[]) {
 
         // Flip
         SDL_RenderPresent(renderer);
+        if(turbo)
+            continue;
 
         uint64_t frame_end = SDL_GetPerformanceCounter();
         uint64_t frame_duration = frame_end - frame_start;
@@ -1818,18 +4764,244 @@ int main(int argc, char* argv[]) {
         uint64_t frame_real_end = SDL_GetPerformanceCounter();
         frame_target -= frame_real_end - frame_end;
 
-        if (frame_target < -100000)
+        if (frame_target < -(int64_t)timer_freq / 10)
         {
             printf("Teleport\n");
             frame_target = 0;
         }
     }
 
+    if(run_result && branch_filename) {
+        for(uint32_t k = 0; k < branch_peeks; k++)
+            run_result->peek[k] = peek(branch_peek[k]);
+        _exit(0);
+    }
+
     printf("Shutting down...\n");
-    SDL_CloseAudioDevice(audio_device);
-    SDL_DestroyRenderer(renderer);
-    SDL_DestroyWindow(window);
+    if(save_state_filename)
+        state_save(save_state_filename);
+    if(movie_out_filename)
+        movie_save(movie_out_filename);
+    double run_seconds = (double)(SDL_GetPerformanceCounter() - run_start) / timer_freq;
+    printf("Emulated %u frames in %.2f s (%.1fx real time)\n", lcd_frame_count, run_seconds, lcd_frame_count / 59.7275 / run_seconds);
+    if(ppu_worker) {
+        SDL_SemWait(ppu_done);
+        ppu_quit = true;
+        SDL_SemPost(ppu_work);
+        SDL_WaitThread(ppu_worker, NULL);
+    }
+    if(rec_writer) {
+        rec_quit = true;
+        SDL_SemPost(rec_full);
+        SDL_WaitThread(rec_writer, NULL);
+        fclose(rec_file);
+        printf("Recorded %u frames to %s, dropped %u\n", rec_frames, rec_filename, rec_dropped);
+    }
+    if(hash_file)
+        fclose(hash_file);
+    if(shm)
+        shm_unlink(shm_path); // readers keep their mapping
+    free(rewind_buf);
+    if(ram != ram_static) {
+        msync(ram, ram_size, MS_SYNC);
+        munmap(ram, ram_size);
+    }
+    if(apu_capturing) {
+        apu_catch_up();
+        apu_flush();
+        if(audio_second_fill)
+            audio_second_done();
+        if(wav_file) {
+            wav_write_header();
+            fclose(wav_file);
+            printf("Wrote %.2f s of audio to %s\n", wav_frames / 48000.0, wav_filename);
+        }
+        if(audio_hash_file)
+            fclose(audio_hash_file);
+    }
+    if(expect_frame && !expect_checked) {
+        printf("Frame %u never reached\n", expect_frame);
+        quit_code = 1;
+    }
+    uint64_t lcd_lines = lcd_lines_drawn + lcd_lines_skipped;
+    printf("Scanlines drawn: %llu, skipped: %llu (%.1f%%)\n", (unsigned long long)lcd_lines_drawn,
+        (unsigned long long)lcd_lines_skipped, lcd_lines ? 100.0 * lcd_lines_skipped / lcd_lines : 0.0);
+    if(!headless) {
+        SDL_CloseAudioDevice(audio_device);
+        printf("Audio underruns: %u, overruns: %u, average fill %.1f ms, rate %+.3f%%\n", apu_underruns, apu_overruns,
+            apu_fill_count ? apu_fill_sum * 1000.0 / apu_fill_count / 48000 : 0.0, apu_drift * 100.0);
+        if(apu_mix_blocks)
+            printf("Audio mixing: %u blocks, %.2f us per block\n", apu_mix_blocks, apu_mix_ticks * 1e6 / timer_freq / apu_mix_blocks);
+        SDL_DestroyRenderer(renderer);
+        SDL_DestroyWindow(window);
+    }
     SDL_Quit();
 
-    return 0;
+    return quit_code;
+}
+#endif
+
+#ifdef GES_LIB
+#include "ges.h"
+
+// Library instances. The live instance is in the globals; the others keep the state that
+// state_sync() covers without full. Cartridge ram and the frame are drawn into stay in each
+// instance's own buffers, which the globals point at while it is live.
+struct GesInstance {
+    uint8_t* rom;
+    uint32_t rom_size;
+    uint8_t mbc_type_id, mbc_type, mbc_rom_size_info, mbc_ram_size_info, mbc_ram_banks;
+    uint16_t mbc_rom_banks;
+    uint32_t ram_size;
+    uint32_t state_words;
+    uint8_t ram[0x20000];
+    uint32_t framebuffer[160 * 144];
+    uint64_t state[STATE_MAX / 8];
+};
+GesInstance* ges_live = NULL;
+uint64_t ges_power_on[STATE_MAX / 8];
+bool ges_initialized = false;
+
+static void ges_activate(GesInstance* g)
+{
+    if(ges_live == g)
+        return;
+    if(ges_live)
+        state_sync(ges_live->state, true, false, false);
+    rom = g->rom;
+    rom_size = g->rom_size;
+    mbc_type_id = g->mbc_type_id;
+    mbc_type = g->mbc_type;
+    mbc_rom_size_info = g->mbc_rom_size_info;
+    mbc_ram_size_info = g->mbc_ram_size_info;
+    mbc_ram_banks = g->mbc_ram_banks;
+    mbc_rom_banks = g->mbc_rom_banks;
+    ram = g->ram;
+    ram_size = g->ram_size;
+    state_words = g->state_words;
+    lcd_out = g->framebuffer;
+    state_sync(g->state, false, false, false);
+    memset(lcd_line_serial, 0, sizeof(lcd_line_serial));
+    mbc_remap();
+    lcd_schedule();
+    ges_live = g;
+}
+
+// Power on with the cartridge in g
+static void ges_reset(GesInstance* g)
+{
+    if(ges_live == g)
+        ges_live = NULL;
+    memcpy(g->state, ges_power_on, sizeof(g->state));
+    memset(g->ram, 0, sizeof(g->ram));
+    memset(g->framebuffer, 0, sizeof(g->framebuffer));
+    ges_activate(g);
+    post_boot_teleport();
+    g->state_words = state_words = state_sync(state_raw, true, true, true);
+}
+
+ges_t* ges_create(void)
+{
+    if(!ges_initialized) {
+        blip_init();
+        lfsr_init();
+        state_sync(ges_power_on, true, false, false); // nothing has run yet
+        ges_initialized = true;
+    }
+    GesInstance* g = (GesInstance*)calloc(1, sizeof(GesInstance));
+    if(!g)
+        return NULL;
+    g->rom = (uint8_t*)malloc(0x8000);
+    memset(g->rom, 0xFF, 0x8000);
+    g->rom_size = 0x8000;
+    g->mbc_rom_banks = 2;
+    g->ram_size = 0x8000;
+    ges_reset(g);
+    return g;
+}
+
+void ges_destroy(ges_t* g)
+{
+    if(ges_live == g)
+        ges_live = NULL;
+    free(g->rom);
+    free(g);
+}
+
+int ges_load_rom(ges_t* g, const uint8_t* data, uint32_t len)
+{
+    if(len > 0x800000)
+        return 0;
+    uint32_t size = len < 0x8000 ? 0x8000 : len;
+    uint8_t* copy = (uint8_t*)malloc(size);
+    if(!copy)
+        return 0;
+    memset(copy, 0xFF, size);
+    memcpy(copy, data, len);
+    ges_activate(g);
+    free(g->rom);
+    rom = g->rom = copy;
+    rom_size = g->rom_size = size;
+    ram_size = 0x8000;
+    cart_init(NULL);
+    g->mbc_type_id = mbc_type_id;
+    g->mbc_type = mbc_type;
+    g->mbc_rom_size_info = mbc_rom_size_info;
+    g->mbc_ram_size_info = mbc_ram_size_info;
+    g->mbc_ram_banks = mbc_ram_banks;
+    g->mbc_rom_banks = mbc_rom_banks;
+    g->ram_size = ram_size;
+    ges_reset(g);
+    return 1;
+}
+
+uint32_t ges_step_frames(ges_t* g, uint32_t n, uint8_t input)
+{
+    ges_activate(g);
+    keys_state = input >> 4;
+    dpad_state = input & 0x0F;
+    uint32_t target = lcd_frame_count + n;
+    while(lcd_frame_count != target)
+        run_cycles(CYCLES_PR_FRAME, target);
+    return lcd_frame_count;
+}
+
+void ges_step_many(ges_t** instances, uint32_t count, uint32_t n, const uint8_t* inputs)
+{
+    for(uint32_t i = 0; i < count; i++)
+        ges_step_frames(instances[i], n, inputs ? inputs[i] : 0);
+}
+
+const uint32_t* ges_framebuffer(ges_t* g)
+{
+    return g->framebuffer;
+}
+
+void ges_read_mem(ges_t* g, uint16_t addr, uint8_t* out, uint32_t len)
+{
+    ges_activate(g);
+    for(uint32_t i = 0; i < len; i++)
+        out[i] = peek((uint16_t)(addr + i));
+}
+
+uint32_t ges_state_size(void)
+{
+    return sizeof(state_packed);
+}
+
+uint32_t ges_save_state(ges_t* g, uint8_t* out, uint32_t size)
+{
+    ges_activate(g);
+    uint32_t len = state_write(state_packed);
+    if(len > size)
+        return 0;
+    memcpy(out, state_packed, len);
+    return len;
+}
+
+int ges_load_state(ges_t* g, const uint8_t* data, uint32_t len)
+{
+    ges_activate(g);
+    return state_read(data, len) ? 1 : 0;
 }
+#endif
@@ -0,0 +1,49 @@
+// libges: the emulator core as a C library, built with make lib (ges.cpp with -DGES_LIB).
+//
+// The machine state is global, so one instance is live at a time. Using another instance swaps
+// it in, which costs about a 64 KB copy; step instances many frames at a time to amortize it.
+// Calls are not thread safe.
+#ifndef GES_H
+#define GES_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GES_API __attribute__((visibility("default")))
+
+typedef struct GesInstance ges_t;
+
+// Input masks: the high nibble is Select/Start/B/A, the low one Down/Up/Left/Right
+GES_API ges_t* ges_create(void);
+GES_API void ges_destroy(ges_t* g);
+
+// Copies the rom and powers the instance on, past the boot rom. Returns 0 if the rom is too big.
+GES_API int ges_load_rom(ges_t* g, const uint8_t* data, uint32_t len);
+
+// Runs until n more frames have completed, with the input held. Returns the frame count.
+GES_API uint32_t ges_step_frames(ges_t* g, uint32_t n, uint8_t input);
+
+// Steps each instance n frames, with inputs[i] held for instances[i] (none if inputs is NULL)
+GES_API void ges_step_many(ges_t** instances, uint32_t count, uint32_t n, const uint8_t* inputs);
+
+// The 160x144 pixels the instance draws into, no copy. Pixels are 0xFFAAAAAA, 0xFF555555 and
+// 0xFF000000 for the darker shades and 0 for the lightest. Holds the last completed frame after
+// ges_step_frames.
+GES_API const uint32_t* ges_framebuffer(ges_t* g);
+
+// Reads memory as the cpu sees it, without side effects. Unusable addresses read 0xFF.
+GES_API void ges_read_mem(ges_t* g, uint16_t addr, uint8_t* out, uint32_t len);
+
+// States are the same as .state files. ges_state_size() is the most a state can take.
+GES_API uint32_t ges_state_size(void);
+GES_API uint32_t ges_save_state(ges_t* g, uint8_t* out, uint32_t size); // 0 if size is too small
+GES_API int ges_load_state(ges_t* g, const uint8_t* data, uint32_t len); // 0 if not a state of this rom
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif